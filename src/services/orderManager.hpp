@@ -5,9 +5,12 @@
 #include "services/userManager.hpp"
 #include "stl/vector.hpp"
 #include "storage/bptStorage.hpp"
+#include "storage/storageBackend.hpp"
 #include "utils/dateTime.hpp"
 #include "utils/logger.hpp"
 #include "utils/string32.hpp"
+#include <algorithm>
+#include <cstdint>
 #include <iomanip>
 #include <iostream>
 #include <limits>
@@ -19,18 +22,18 @@ using sjtu::vector;
 
 enum OrderStatus { SUCCESS, PENDING, REFUNDED };
 
+/**
+ * @brief An order as it is stored, 48 bytes. The train is kept by its hash and
+ * the stations by their index on its route, times as minutes after midnight of
+ * the day the train leaves its START station; see OrderLine for the names.
+ */
 struct Order {
-  string32 username;
-  string32 trainID;
-  string32 from_station_name;
+  size_t hashedTrainID;
   int from_station_idx; // 0-based index
-  string32 to_station_name;
-  int to_station_idx; // 0-based index
-  DateTime
-      departureDateTime; // DateTime train departs from train's START station.
-  DateTime departureFromStation; // DateTime train departs from this leg's
-                                 // departure station.
-  DateTime arrivalAtStation;
+  int to_station_idx;   // 0-based index
+  int startDate;        // MMDD the train departs from its START station
+  int leaving;          // minutes after startDate when it leaves from
+  int arriving;         // minutes after startDate when it arrives at to
 
   int price;
   int num;
@@ -38,15 +41,11 @@ struct Order {
   int timestamp;
 
   Order() = default;
-  Order(const string32 &un, const string32 &tid, const string32 &fr_name,
-        int fr_idx, const string32 &to_name, int to_idx,
-        const DateTime &depDateTime, const DateTime &depFromStation,
-        const DateTime &arrAtStation, int pr, int n, OrderStatus st, int ts)
-      : username(un), trainID(tid), from_station_name(fr_name),
-        from_station_idx(fr_idx), to_station_name(to_name),
-        to_station_idx(to_idx), departureDateTime(depDateTime),
-        departureFromStation(depFromStation), arrivalAtStation(arrAtStation),
-        price(pr), num(n), status(st), timestamp(ts) {}
+  Order(size_t tid, int fr_idx, int to_idx, int start, int lv, int ar, int pr,
+        int n, OrderStatus st, int ts)
+      : hashedTrainID(tid), from_station_idx(fr_idx), to_station_idx(to_idx),
+        startDate(start), leaving(lv), arriving(ar), price(pr), num(n),
+        status(st), timestamp(ts) {}
 
   bool operator<(const Order &other) const {
     return timestamp < other.timestamp;
@@ -61,11 +60,23 @@ struct Order {
   }
 
   bool operator==(const Order &other) const {
-    return username == other.username && trainID == other.trainID &&
+    return hashedTrainID == other.hashedTrainID &&
            timestamp == other.timestamp; // faster, do not compare all fields
   }
+};
+
+/**
+ * @brief An order with the names of its train and stations, as query_order
+ * prints it.
+ */
+struct OrderLine {
+  Order order;
+  string32 trainID;
+  string32 from_station_name;
+  string32 to_station_name;
 
-  friend std::ostream &operator<<(std::ostream &os, const Order &order) {
+  friend std::ostream &operator<<(std::ostream &os, const OrderLine &line) {
+    const Order &order = line.order;
     os << "[";
     switch (order.status) {
     case SUCCESS:
@@ -80,13 +91,17 @@ struct Order {
     }
     os << "] ";
 
-    os << order.trainID.toString() << " " << order.from_station_name.toString()
-       << " " << order.departureFromStation.getDateString() << " "
-       << order.departureFromStation.getTimeString() << " -> ";
+    DateTime departureFromStation(order.startDate);
+    departureFromStation.addDuration(order.leaving);
+    DateTime arrivalAtStation(order.startDate);
+    arrivalAtStation.addDuration(order.arriving);
+    os << line.trainID.toString() << " " << line.from_station_name.toString()
+       << " " << departureFromStation.getDateString() << " "
+       << departureFromStation.getTimeString() << " -> ";
 
-    os << order.to_station_name.toString() << " "
-       << order.arrivalAtStation.getDateString() << " "
-       << order.arrivalAtStation.getTimeString();
+    os << line.to_station_name.toString() << " "
+       << arrivalAtStation.getDateString() << " "
+       << arrivalAtStation.getTimeString();
 
     os << " " << order.price / order.num << " " << order.num;
 
@@ -94,11 +109,311 @@ struct Order {
   }
 };
 
+/**
+ * @brief The seats a queued order waits for, all a pending queue entry holds
+ * besides its key.
+ * @note A key names exactly one order, so the values under it all compare
+ * equal and remove() finds an entry by its key alone.
+ */
+struct PendingOrder {
+  short from_station_idx;
+  short to_station_idx;
+  int num;
+
+  bool operator<(const PendingOrder &) const { return false; }
+  bool operator>(const PendingOrder &) const { return false; }
+  bool operator<=(const PendingOrder &) const { return true; }
+  bool operator==(const PendingOrder &) const { return true; }
+};
+
+/**
+ * @brief Orders by ID, and the IDs of each user's orders in the order they
+ * were made.
+ * @note A user's IDs fill chunks of CHUNK, each pointing back to the one
+ * before, and logDB maps the user to the newest. Appending touches that chunk
+ * only, and the n-th newest order is found by walking back over the chunks
+ * of the n - 1 orders after it.
+ */
+class OrderLog {
+public:
+  static constexpr int CHUNK = 61; // a chunk fills 256 bytes
+
+private:
+  struct Chunk {
+    int prev;  // the chunk before, -1 for the first
+    int base;  // orders of the user before this chunk
+    int count; // IDs in use
+    int ids[CHUNK];
+  };
+
+  DefaultPageManager<Order, 2> orders; // ID -> Order
+  DefaultPageManager<Chunk, 2> chunks;
+  BPTStorage<size_t, int, 500, 100> logDB; // username -> newest chunk
+
+  int newestChunk(size_t user) {
+    auto it = logDB.lower_bound(user);
+    return it.valid() && it.key() == user ? it.value() : -1;
+  }
+
+public:
+  OrderLog(const std::string &orderFile)
+      : orders(orderFile + "_table"), chunks(orderFile + "_chunk"),
+        logDB(orderFile + "_log", std::numeric_limits<size_t>::max()) {
+    orders.initialise();
+    chunks.initialise();
+  }
+
+  /**
+   * @return ID of the order.
+   */
+  int append(size_t user, Order &order) {
+    int id = orders.append(order);
+    int newest = newestChunk(user);
+    Chunk chunk;
+    if (newest != -1) {
+      chunks.read(chunk, newest);
+      if (chunk.count < CHUNK) {
+        chunk.ids[chunk.count++] = id;
+        chunks.update(chunk, newest);
+        return id;
+      }
+    }
+    Chunk next;
+    next.prev = newest;
+    next.base = newest == -1 ? 0 : chunk.base + chunk.count;
+    next.count = 1;
+    next.ids[0] = id;
+    int index = chunks.append(next);
+    if (newest != -1) {
+      logDB.remove(user, newest);
+    }
+    logDB.insert(user, index);
+    return id;
+  }
+
+  /**
+   * @brief Number of orders of user.
+   */
+  int count(size_t user) {
+    int newest = newestChunk(user);
+    if (newest == -1) {
+      return 0;
+    }
+    Chunk chunk;
+    chunks.read(chunk, newest);
+    return chunk.base + chunk.count;
+  }
+
+  /**
+   * @return ID of the n-th newest order of user, 1-based, or -1 if there is
+   * no such order.
+   */
+  int find(size_t user, int n) {
+    int newest = newestChunk(user);
+    if (newest == -1 || n <= 0) {
+      return -1;
+    }
+    Chunk chunk;
+    chunks.read(chunk, newest);
+    int pos = chunk.base + chunk.count - n;
+    if (pos < 0) {
+      return -1;
+    }
+    while (pos < chunk.base) {
+      chunks.read(chunk, chunk.prev);
+    }
+    return chunk.ids[pos - chunk.base];
+  }
+
+  /**
+   * @brief Every order of user, oldest first.
+   */
+  vector<Order> list(size_t user) {
+    vector<int> ids; // newest first
+    Chunk chunk;
+    for (int index = newestChunk(user); index != -1; index = chunk.prev) {
+      chunks.read(chunk, index);
+      for (int j = chunk.count - 1; j >= 0; --j) {
+        ids.push_back(chunk.ids[j]);
+      }
+    }
+    vector<Order> result;
+    for (int i = ids.size() - 1; i >= 0; --i) {
+      Order order;
+      orders.read(order, ids[i]);
+      result.push_back(order);
+    }
+    return result;
+  }
+
+  void read(Order &order, int id) { orders.read(order, id); }
+  void update(Order &order, int id) { orders.update(order, id); }
+
+  void flush() {
+    orders.flush();
+    chunks.flush();
+    logDB.flush();
+  }
+
+  void sync() {
+    orders.sync();
+    chunks.sync();
+    logDB.sync();
+  }
+
+  void compact() { logDB.compact(); }
+};
+
+/**
+ * @brief A bound on the orders queued for one run: no waiter asks for fewer
+ * than minNum seats, and every segment a waiter's leg covers has its bit set.
+ * @note Segments past the last bit share it, so overlaps() may report a false
+ * positive on very long trains but never misses an overlap.
+ */
+struct PendingSummary {
+  static constexpr int BITS = 128;
+
+  int minNum;
+  uint64_t covered[BITS / 64];
+
+  PendingSummary() : minNum(std::numeric_limits<int>::max()), covered{} {}
+
+  bool empty() const { return minNum == std::numeric_limits<int>::max(); }
+
+  void add(int from, int to, int num) {
+    minNum = std::min(minNum, num);
+    for (int w = 0; w < BITS / 64; ++w) {
+      covered[w] |= mask(w, from, to);
+    }
+  }
+
+  /**
+   * @return whether some waiter's leg may share a segment with [from, to).
+   */
+  bool overlaps(int from, int to) const {
+    for (int w = 0; w < BITS / 64; ++w) {
+      if (covered[w] & mask(w, from, to)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  // Bits of word w for the segments in [from, to).
+  static uint64_t mask(int w, int from, int to) {
+    int lo = std::max(std::min(from, BITS - 1), w * 64);
+    int hi = std::min(std::min(to - 1, BITS - 1), w * 64 + 63);
+    if (lo > hi) {
+      return 0;
+    }
+    return (~uint64_t(0) >> (63 - (hi - lo))) << (lo - w * 64);
+  }
+};
+
+/**
+ * @brief The PendingSummary of every run with orders queued.
+ * @note Queuing an order widens its run's summary, and orders leaving the
+ * queue never narrow it; put() writes the exact one after a run is scanned.
+ */
+class PendingSummaries {
+private:
+  DefaultPageManager<PendingSummary, 2> records;
+  BPTStorage<std::pair<size_t, int>, int, 200, 100>
+      indexDB; // <hashed trainID, depDate> -> record
+
+  int locate(const std::pair<size_t, int> &run) {
+    auto it = indexDB.lower_bound(run);
+    return it.valid() && it.key() == run ? it.value() : -1;
+  }
+
+  void store(const std::pair<size_t, int> &run, int index,
+             PendingSummary &summary) {
+    if (index != -1) {
+      records.update(summary, index);
+    } else {
+      indexDB.insert(run, records.write(summary));
+    }
+  }
+
+public:
+  PendingSummaries(const std::string &file)
+      : records(file + "_record"),
+        indexDB(file + "_index",
+                std::make_pair(std::numeric_limits<size_t>::max(), INT_MAX)) {
+    records.initialise();
+  }
+
+  /**
+   * @return false if no order is queued for run.
+   */
+  bool get(const std::pair<size_t, int> &run, PendingSummary &summary) {
+    int index = locate(run);
+    if (index == -1) {
+      return false;
+    }
+    records.read(summary, index);
+    return true;
+  }
+
+  void add(const std::pair<size_t, int> &run, int from, int to, int num) {
+    PendingSummary summary;
+    int index = locate(run);
+    if (index != -1) {
+      records.read(summary, index);
+    }
+    summary.add(from, to, num);
+    store(run, index, summary);
+  }
+
+  void put(const std::pair<size_t, int> &run, PendingSummary &summary) {
+    store(run, locate(run), summary);
+  }
+
+  void erase(const std::pair<size_t, int> &run) {
+    int index = locate(run);
+    if (index != -1) {
+      indexDB.remove(run, index);
+      records.remove(index);
+    }
+  }
+
+  void flush() {
+    records.flush();
+    indexDB.flush();
+  }
+
+  void sync() {
+    records.sync();
+    indexDB.sync();
+  }
+
+  void compact() { indexDB.compact(); }
+};
+
 class OrderManager {
 private:
-  BPTStorage<size_t, Order, 500, 17> orderDB; // username -> Order
-  BPTStorage<std::pair<string32, int>, Order, 80, 17>
-      pendingQueue; // <trainID, depDate> -> Order
+  // <hashed trainID, depDate << 32 | order ID>: a run's queue is one key range
+  // in the order it was asked for, as order IDs grow with time.
+  using PendingKey = std::pair<size_t, size_t>;
+
+  // A node and a block of the pending queue each fill a 4 KiB page.
+  static constexpr size_t PENDING_NODE_SIZE = 203;
+  static constexpr size_t PENDING_BLOCK_SIZE = 169;
+  static_assert(sizeof(BPTNode<PendingKey, PENDING_NODE_SIZE>) <= 4096 &&
+                    sizeof(DataBlock<PendingKey, PendingOrder,
+                                     PENDING_BLOCK_SIZE>) <= 4096,
+                "pending queue pages outgrow 4 KiB");
+
+  static PendingKey pendingKey(size_t hashedTrainID, int date, int orderID) {
+    return {hashedTrainID, static_cast<size_t>(date) << 32 |
+                               static_cast<unsigned>(orderID)};
+  }
+
+  OrderLog orderLog; // username -> orders
+  BPTStorage<PendingKey, PendingOrder, PENDING_NODE_SIZE, PENDING_BLOCK_SIZE>
+      pendingQueue; // queued order -> the seats it waits for
+  PendingSummaries pendingSummaries;
   CustomStringHasher stringHasher;
 
   TrainManager *trainManager_ptr;
@@ -107,7 +422,10 @@ public:
   OrderManager() = delete;
   OrderManager(const std::string &orderFile, TrainManager *tm);
 
-  vector<Order> queryOrder(const string32 &username);
+  /**
+   * @return the user's orders, oldest first, with their names resolved.
+   */
+  vector<OrderLine> queryOrder(const string32 &username);
 
   /**
    * @brief Attempts to buy a ticket.
@@ -141,31 +459,54 @@ public:
    */
   bool refundTicket(const string32 &username, int orderIndex);
 
+  /**
+   * @brief Write dirty pages back; with durable set, also fsync every file.
+   */
+  void flush(bool durable = false);
+
+  /**
+   * @brief Rewrite the order log and pending trees without their freed pages.
+   */
+  void compact();
+
 private:
   /**
    * @brief Processes pending orders for a given train on a specific departure
    * date (from train's origin).
-   * @param trainID The train ID.
-   * @param date_str The train's departure date from its STARTING STATION
-   * (format "MM-DD").
+   * @param hashedTrainID Hash of the train ID.
+   * @param origin_date_mmdd The train's departure date from its STARTING
+   * STATION (MMDD).
+   * @param from_idx, to_idx Stations of the leg whose seats were refunded.
    */
-  void processPendingOrders(const string32 &trainID, int origin_date_mmdd);
+  void processPendingOrders(size_t hashedTrainID, int origin_date_mmdd,
+                            int from_idx, int to_idx);
 };
 
 OrderManager::OrderManager(const std::string &orderFile, TrainManager *tm)
-    : orderDB(orderFile + "_order", std::numeric_limits<size_t>::max()),
+    : orderLog(orderFile + "_order"),
       pendingQueue(orderFile + "_pending",
-                   std::make_pair(string32::string32_MAX(), INT_MAX)),
-      trainManager_ptr(tm) {
+                   std::make_pair(std::numeric_limits<size_t>::max(),
+                                  std::numeric_limits<size_t>::max())),
+      pendingSummaries(orderFile + "_pending_summary"), trainManager_ptr(tm) {
   LOG("OrderManager initialized with file: " + orderFile);
 }
 
-vector<Order> OrderManager::queryOrder(const string32 &username) {
+vector<OrderLine> OrderManager::queryOrder(const string32 &username) {
   LOG("Querying orders for user: " + username.toString());
-  vector<Order> orders = orderDB.find(stringHasher(username.c_str()));
-  LOG("Found " + std::to_string(orders.size()) +
+  vector<Order> orders = orderLog.list(stringHasher(username.c_str()));
+  vector<OrderLine> lines;
+  for (const Order &order : orders) {
+    // A train with orders is released, so it can no longer be deleted.
+    const TrainCatalog::Entry *entry =
+        trainManager_ptr->getTrain(order.hashedTrainID, true);
+    StationRun stations = trainManager_ptr->catalog.stations(entry);
+    lines.push_back(OrderLine{order, entry->train.trainID,
+                              stations.names[order.from_station_idx],
+                              stations.names[order.to_station_idx]});
+  }
+  LOG("Found " + std::to_string(lines.size()) +
       " orders for user: " + username.toString());
-  return orders;
+  return lines;
 }
 
 int OrderManager::buyTicket(const string32 &username, const string32 &trainID,
@@ -194,32 +535,28 @@ int OrderManager::buyTicket(const string32 &username, const string32 &trainID,
       trainManager_ptr->buyTicket(trainID, trainOriginDepDate, num_tickets,
                                   from_station_name, to_station_name);
 
+  size_t hashedTrainID = stringHasher(trainID.c_str());
   if (price != -1 && origin_date_mmdd != -1 && isSuccessful) {
-    DateTime departureFromStation = DateTime(origin_date_mmdd);
-    departureFromStation.addDuration(depTimeOffset);
-    DateTime arrivalAtStation = DateTime(origin_date_mmdd);
-    arrivalAtStation.addDuration(arrTimeOffset);
-    Order newOrder(username, trainID, from_station_name, from_idx,
-                   to_station_name, to_idx, DateTime(origin_date_mmdd),
-                   departureFromStation, arrivalAtStation, price, num_tickets,
-                   SUCCESS, timestamp);
-    orderDB.insert(stringHasher(username.c_str()), newOrder);
+    Order newOrder(hashedTrainID, from_idx, to_idx, origin_date_mmdd,
+                   depTimeOffset, arrTimeOffset, price, num_tickets, SUCCESS,
+                   timestamp);
+    orderLog.append(stringHasher(username.c_str()), newOrder);
     LOG("Ticket purchase successful - User: " + username.toString() +
         ", Train: " + trainID.toString() + ", Price: " + std::to_string(price));
     return price;
   } else {
     if (price != -1 && origin_date_mmdd != -1 && !isSuccessful &&
         queueIfNotAvailable) {
-      DateTime departureFromStation = DateTime(origin_date_mmdd);
-      departureFromStation.addDuration(depTimeOffset);
-      DateTime arrivalAtStation = DateTime(origin_date_mmdd);
-      arrivalAtStation.addDuration(arrTimeOffset);
-      Order newOrder(username, trainID, from_station_name, from_idx,
-                     to_station_name, to_idx, DateTime(origin_date_mmdd),
-                     departureFromStation, arrivalAtStation, price, num_tickets,
-                     PENDING, timestamp);
-      orderDB.insert(stringHasher(username.c_str()), newOrder);
-      pendingQueue.insert(std::make_pair(trainID, origin_date_mmdd), newOrder);
+      Order newOrder(hashedTrainID, from_idx, to_idx, origin_date_mmdd,
+                     depTimeOffset, arrTimeOffset, price, num_tickets, PENDING,
+                     timestamp);
+      int orderID = orderLog.append(stringHasher(username.c_str()), newOrder);
+      pendingQueue.insert(
+          pendingKey(hashedTrainID, origin_date_mmdd, orderID),
+          PendingOrder{static_cast<short>(from_idx),
+                       static_cast<short>(to_idx), num_tickets});
+      pendingSummaries.add(std::make_pair(hashedTrainID, origin_date_mmdd),
+                           from_idx, to_idx, num_tickets);
       LOG("Ticket purchase queued - User: " + username.toString() +
           ", Train: " + trainID.toString());
       return 0; // Pending
@@ -241,53 +578,52 @@ bool OrderManager::refundTicket(const string32 &username,
     return false;
   }
 
-  vector<Order> userOrders = orderDB.find(stringHasher(username.c_str()));
-
-  if (static_cast<size_t>(orderIndex) > userOrders.size()) {
+  size_t hashedUser = stringHasher(username.c_str());
+  int orderID = orderLog.find(hashedUser, orderIndex);
+  if (orderID == -1) {
     ERROR("Order index out of range - User: " + username.toString() +
           ", Index: " + std::to_string(orderIndex) +
-          ", Total orders: " + std::to_string(userOrders.size()));
+          ", Total orders: " + std::to_string(orderLog.count(hashedUser)));
     return false;
   }
 
-  Order orderToRefund = userOrders[userOrders.size() - orderIndex];
+  Order orderToRefund;
+  orderLog.read(orderToRefund, orderID);
 
   // std::cout << "Refunding order: " << orderToRefund << std::endl;
 
   if (orderToRefund.status == REFUNDED) {
     LOG("Order already refunded - User: " + username.toString() +
-        ", Train: " + orderToRefund.trainID.toString());
+        ", Train: " + std::to_string(orderToRefund.hashedTrainID));
     return false; // Already refunded
   }
 
   auto originalState = orderToRefund.status;
 
   if (orderToRefund.status == SUCCESS || orderToRefund.status == PENDING) {
-    orderDB.remove(stringHasher(username.c_str()), orderToRefund);
     if (originalState == PENDING) {
-      pendingQueue.remove(
-          std::make_pair(orderToRefund.trainID,
-                         orderToRefund.departureDateTime.getDateMMDD()),
-          orderToRefund);
+      pendingQueue.remove(pendingKey(orderToRefund.hashedTrainID,
+                                     orderToRefund.startDate, orderID),
+                          PendingOrder{});
     }
     orderToRefund.status = REFUNDED;
-    orderDB.insert(stringHasher(username.c_str()), orderToRefund);
+    orderLog.update(orderToRefund, orderID);
 
     if (originalState == SUCCESS) {
       int from_idx = orderToRefund.from_station_idx;
       int to_idx = orderToRefund.to_station_idx;
       if (from_idx != -1 && to_idx != -1) {
-        trainManager_ptr->refundTicket(orderToRefund.trainID,
-                                       orderToRefund.departureDateTime,
+        trainManager_ptr->refundTicket(orderToRefund.hashedTrainID,
+                                       DateTime(orderToRefund.startDate),
                                        orderToRefund.num, from_idx, to_idx);
       }
 
-      processPendingOrders(orderToRefund.trainID,
-                           orderToRefund.departureDateTime.getDateMMDD());
+      processPendingOrders(orderToRefund.hashedTrainID, orderToRefund.startDate,
+                           from_idx, to_idx);
     }
 
     LOG("Ticket refund successful - User: " + username.toString() +
-        ", Train: " + orderToRefund.trainID.toString() +
+        ", Train: " + std::to_string(orderToRefund.hashedTrainID) +
         ", Status was: " + (originalState == SUCCESS ? "SUCCESS" : "PENDING"));
     return true;
   }
@@ -296,40 +632,108 @@ bool OrderManager::refundTicket(const string32 &username,
   return false;
 }
 
-void OrderManager::processPendingOrders(const string32 &trainID,
-                                        int origin_date_mmdd) {
-  LOG("Processing pending orders for train: " + trainID.toString() +
+void OrderManager::flush(bool durable) {
+  if (durable) {
+    orderLog.sync();
+    pendingQueue.sync();
+    pendingSummaries.sync();
+  } else {
+    orderLog.flush();
+    pendingQueue.flush();
+    pendingSummaries.flush();
+  }
+}
+
+void OrderManager::compact() {
+  orderLog.compact();
+  pendingQueue.compact();
+  pendingSummaries.compact();
+}
+
+void OrderManager::processPendingOrders(size_t hashedTrainID,
+                                        int origin_date_mmdd, int from_idx,
+                                        int to_idx) {
+  LOG("Processing pending orders for train: " + std::to_string(hashedTrainID) +
       ", Date: " + std::to_string(origin_date_mmdd));
 
-  vector<Order> candidates =
-      pendingQueue.find(std::make_pair(trainID, origin_date_mmdd));
-
-  LOG("Found " + std::to_string(candidates.size()) +
-      " pending orders to process");
-
-  int processedCount = 0;
-  for (const Order &pendingOrder : candidates) {
-    bool success = trainManager_ptr->updateLeftSeats(
-        pendingOrder.trainID, pendingOrder.departureDateTime,
-        pendingOrder.from_station_idx, pendingOrder.to_station_idx,
-        -pendingOrder.num);
-
-    if (success) {
-      pendingQueue.remove(std::make_pair(trainID, origin_date_mmdd),
-                          pendingOrder);
-      orderDB.remove(stringHasher(pendingOrder.username.c_str()), pendingOrder);
-      Order updatedOrder = pendingOrder;
-      updatedOrder.status = SUCCESS;
-      orderDB.insert(stringHasher(updatedOrder.username.c_str()), updatedOrder);
-      processedCount++;
-
-      LOG("Pending order promoted to SUCCESS - User: " +
-          pendingOrder.username.toString() +
-          ", Train: " + pendingOrder.trainID.toString());
+  std::pair<size_t, int> run(hashedTrainID, origin_date_mmdd);
+  PendingSummary summary;
+  if (!pendingSummaries.get(run, summary) ||
+      !summary.overlaps(from_idx, to_idx)) {
+    LOG("No pending order shares a segment with the refunded leg");
+    return;
+  }
+  // A leg that shares a segment with [from_idx, to_idx) has no more seats
+  // left than that segment does.
+  vector<int> left = trainManager_ptr->queryLeftSeats(
+      hashedTrainID, DateTime(origin_date_mmdd));
+  int most = 0;
+  for (int i = from_idx; i < to_idx && i < static_cast<int>(left.size()); ++i) {
+    most = std::max(most, left[i]);
+  }
+  if (summary.minNum > most) {
+    LOG("Every pending order asks for more than " + std::to_string(most) +
+        " seats");
+    return;
+  }
+
+  // Only seats on [from_idx, to_idx) came back, and every order still queued
+  // did not fit before that, so the others cannot fit now either.
+  vector<int> candidates; // order IDs
+  vector<SeatRequest> requests;
+  PendingSummary rest; // of the orders left in the queue
+  size_t queued = 0;
+  pendingQueue.range(
+      pendingKey(hashedTrainID, origin_date_mmdd, 0),
+      pendingKey(hashedTrainID, origin_date_mmdd, INT_MAX),
+      [&](const PendingKey &key, const PendingOrder &pendingOrder) {
+        queued++;
+        if (pendingOrder.from_station_idx < to_idx &&
+            from_idx < pendingOrder.to_station_idx) {
+          candidates.push_back(static_cast<int>(key.second & 0xffffffff));
+          requests.push_back(SeatRequest{pendingOrder.from_station_idx,
+                                         pendingOrder.to_station_idx,
+                                         pendingOrder.num});
+        } else {
+          rest.add(pendingOrder.from_station_idx,
+                   pendingOrder.to_station_idx, pendingOrder.num);
+        }
+        return true;
+      });
+
+  LOG("Found " + std::to_string(candidates.size()) + " of " +
+      std::to_string(queued) + " pending orders to process");
+
+  vector<int> taken;
+  if (!candidates.empty()) {
+    taken = trainManager_ptr->takeSeats(hashedTrainID,
+                                        DateTime(origin_date_mmdd), requests);
+  }
+  size_t next = 0;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (next == taken.size() || taken[next] != static_cast<int>(i)) {
+      rest.add(requests[i].from, requests[i].to, requests[i].num);
+      continue;
     }
+    next++;
+    int orderID = candidates[i];
+    pendingQueue.remove(pendingKey(hashedTrainID, origin_date_mmdd, orderID),
+                        PendingOrder{});
+    Order updatedOrder;
+    orderLog.read(updatedOrder, orderID);
+    updatedOrder.status = SUCCESS;
+    orderLog.update(updatedOrder, orderID);
+
+    LOG("Pending order promoted to SUCCESS - Order: " +
+        std::to_string(orderID) + ", Train: " + std::to_string(hashedTrainID));
+  }
+  if (rest.empty()) {
+    pendingSummaries.erase(run);
+  } else {
+    pendingSummaries.put(run, rest);
   }
 
-  LOG("Processed " + std::to_string(processedCount) +
+  LOG("Processed " + std::to_string(taken.size()) +
       " pending orders successfully");
 }
 
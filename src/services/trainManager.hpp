@@ -4,14 +4,18 @@
 #include "stl/map.hpp"
 #include "stl/vector.hpp"
 #include "storage/bptStorage.hpp"
-#include "storage/cache/fileOperation.hpp"
+#include "storage/storageBackend.hpp"
 #include "storage/varLengthFileOperation.hpp"
 #include "utils/dateFormatter.hpp"
 #include "utils/dateTime.hpp"
 #include "utils/logger.hpp"
 #include "utils/splitString.hpp"
 #include "utils/string32.hpp"
+#include <algorithm>
 #include <climits>
+#include <cstdio>
+#include <cstring>
+#include <limits>
 #include <ostream>
 #include <sstream>
 #include <string>
@@ -20,49 +24,283 @@ using sjtu::map;
 using sjtu::string32;
 using sjtu::vector;
 
-struct Station {
-  bool isStart;
-  bool isEnd;
-  string32 name;
-  int price;
-  int arrivalTimeOffset;
-  int leavingTimeOffset;
-  int index; // 0-based index
+/**
+ * @brief A train's stations column by column, over one block of words.
+ * @note The block holds the name hashes, the fares from the first station,
+ * the arrival and the leaving offsets, then the names, each column count long.
+ * It is stored as is, so a train's stations are read in one go.
+ */
+struct StationRun {
+  int count;
+  const size_t *hashes;
+  const int *priceSums; // fare from the first station
+  const int *arrivals;  // minutes after the start, -1 at the first station
+  const int *leavings;  // minutes after the start, -1 at the last station
+  const string32 *names;
+
+  StationRun(const size_t *block, int count)
+      : count(count), hashes(block),
+        priceSums(reinterpret_cast<const int *>(block + count)),
+        arrivals(priceSums + count), leavings(arrivals + count),
+        names(reinterpret_cast<const string32 *>(leavings + count)) {}
+
+  /**
+   * @return words a block of count stations takes.
+   */
+  static size_t words(int count) {
+    size_t bytes =
+        count * (sizeof(size_t) + 3 * sizeof(int) + sizeof(string32));
+    return (bytes + sizeof(size_t) - 1) / sizeof(size_t);
+  }
+
+  /**
+   * @return 0-based index of the station, -1 if the train does not stop there.
+   */
+  int find(size_t hash, const string32 &name) const {
+    for (int i = 0; i < count; ++i) {
+      if (hashes[i] == hash && names[i] == name) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  int price(int from, int to) const { return priceSums[to] - priceSums[from]; }
 };
 
-class StationBucketManager {
+/**
+ * @tparam File byte-level backend holding the station runs.
+ */
+template <class File = DefaultByteFile> class StationBucketManager {
 private:
-  FileOperation<Station> stationBucket;
+  File stationBucket;
+  std::string fileName;
 
 public:
   StationBucketManager() = delete;
   StationBucketManager(const std::string &stationFile)
-      : stationBucket(stationFile) {
-    stationBucket.initialise();
+      : fileName(stationFile) {
+    stationBucket.open(stationFile);
     LOG("StationBucketManager initialized with file: " + stationFile);
   }
-  int addStations(vector<Station> &stations);
-  bool deleteStations(int bucketID, int num);
-  vector<Station> queryStations(int bucketID, int num);
+  int addStations(const vector<size_t> &hashes, const vector<int> &priceSums,
+                  const vector<int> &arrivals, const vector<int> &leavings,
+                  const vector<string32> &names);
+  /**
+   * @return the block of the run at bucketID, for a StationRun of num.
+   */
+  vector<size_t> queryStations(int bucketID, int num);
+  /**
+   * @brief Copy the given runs, as (bucket ID, stations), back to back into a
+   * fresh file and swap it in; runs not given, those of deleted trains, are
+   * dropped.
+   * @return the new bucket ID of each run, in the order given.
+   */
+  vector<int> compact(const vector<std::pair<int, int>> &runs);
+  void sync() { stationBucket.sync(); }
 };
 
+/**
+ * @brief Seats left on each segment of one run of a train, with range add and
+ * range min in blocks of BLOCK segments.
+ * @note The run is stored as its segments, then the min of each block, then
+ * what was added to each whole block. A segment holds its seats less that
+ * pending add, a block min already includes it, so a range touches at most
+ * two partial blocks segment by segment and every block between them once.
+ */
+class SeatRow {
+public:
+  static constexpr int BLOCK = 16;
+
+  static constexpr int blocks(int segments) {
+    return (segments + BLOCK - 1) / BLOCK;
+  }
+  static constexpr int size(int segments) {
+    return segments + 2 * blocks(segments);
+  }
+
+  SeatRow(int *row, int segments)
+      : seats(row), blockMin(row + segments),
+        blockAdd(row + segments + blocks(segments)), segments(segments) {}
+
+  /**
+   * @brief Fewest seats left on the segments in [from, to).
+   */
+  int min(int from, int to) const {
+    int first = from / BLOCK, last = (to - 1) / BLOCK;
+    if (first == last) {
+      return scan(from, to) + blockAdd[first];
+    }
+    int best = scan(from, (first + 1) * BLOCK) + blockAdd[first];
+    for (int b = first + 1; b < last; ++b) {
+      best = std::min(best, blockMin[b]);
+    }
+    return std::min(best, scan(last * BLOCK, to) + blockAdd[last]);
+  }
+
+  /**
+   * @brief Add delta to the seats left on the segments in [from, to).
+   */
+  void add(int from, int to, int delta) {
+    int first = from / BLOCK, last = (to - 1) / BLOCK;
+    if (first == last) {
+      addPartial(first, from, to, delta);
+      return;
+    }
+    addPartial(first, from, (first + 1) * BLOCK, delta);
+    for (int b = first + 1; b < last; ++b) {
+      blockMin[b] += delta;
+      blockAdd[b] += delta;
+    }
+    addPartial(last, last * BLOCK, to, delta);
+  }
+
+  /**
+   * @brief Seats left on every segment, in order.
+   */
+  vector<int> values() const {
+    vector<int> left(segments, 0);
+    for (int i = 0; i < segments; ++i) {
+      left[i] = seats[i] + blockAdd[i / BLOCK];
+    }
+    return left;
+  }
+
+  /**
+   * @brief Fill a row whose segments all have init seats.
+   */
+  static void init(int *row, int segments, int init) {
+    for (int i = 0; i < segments + blocks(segments); ++i) {
+      row[i] = init;
+    }
+    for (int i = segments + blocks(segments); i < size(segments); ++i) {
+      row[i] = 0;
+    }
+  }
+
+private:
+  int *seats;
+  int *blockMin;
+  int *blockAdd;
+  int segments;
+
+  int scan(int from, int to) const {
+    int best = seats[from];
+    for (int i = from + 1; i < to; ++i) {
+      best = std::min(best, seats[i]);
+    }
+    return best;
+  }
+
+  void addPartial(int b, int from, int to, int delta) {
+    if (from == b * BLOCK && to == std::min(segments, (b + 1) * BLOCK)) {
+      blockMin[b] += delta; // the whole block
+      blockAdd[b] += delta;
+      return;
+    }
+    for (int i = from; i < to; ++i) {
+      seats[i] += delta;
+    }
+    blockMin[b] =
+        scan(b * BLOCK, std::min(segments, (b + 1) * BLOCK)) + blockAdd[b];
+  }
+};
+
+/**
+ * @brief num seats asked for on the segments in [from, to).
+ */
+struct SeatRequest {
+  int from;
+  int to;
+  int num;
+};
+
+/**
+ * @brief Seat rows of released trains, one per sale day back to back.
+ * @note Rows are cached with LRU-K replacement and changed in place, so buying
+ * and querying a hot run touch no file. A dirty row is written back when
+ * evicted, on flush() and on destruction. Trains of more than MAX_SEGMENTS
+ * segments do not fit a frame and go to the file one row at a time.
+ */
 class TicketBucketManager {
+public:
+  static constexpr int MAX_SEGMENTS = 99; // 100 stations
+
 private:
-  VarLengthIntArrayFileOperation ticketBucket;
+  struct Frame {
+    int bucketID;
+    int day;
+    int segments;
+    int row[SeatRow::size(MAX_SEGMENTS)];
+  };
+
+  VarLengthIntArrayFileOperation<DefaultByteFile> ticketBucket;
+  LRUKCache<int, Frame, 4, buffer_pool_frames<Frame>()> rows; // by offset
+  vector<int> spill;    // the pinned row when it is not in a frame
+  bool spilled = false; // whether the pinned row is spill
+  size_t reads = 0, hits = 0; // of pinRow(), hits found the row cached
+
+  static int offset(int bucketID, int day, int segments) {
+    return bucketID + (1 + day * SeatRow::size(segments)) * sizeof(int);
+  }
+
+  static void write_back(const int &, const Frame &frame, void *context) {
+    auto *self = static_cast<TicketBucketManager *>(context);
+    self->writeDay(frame.bucketID, frame.day, frame.segments, frame.row);
+  }
+
+  void writeDay(int bucketID, int day, int segments, const int *row) {
+    int size = SeatRow::size(segments);
+    ticketBucket.update(bucketID, day * size, size, row);
+  }
 
 public:
   TicketBucketManager() = delete;
   TicketBucketManager(const std::string &ticketFile)
-      : ticketBucket(ticketFile) {
+      : ticketBucket(ticketFile), rows(write_back, this) {
     ticketBucket.initialise();
     LOG("TicketBucketManager initialized with file: " + ticketFile);
   }
-  int addTickets(int num_days, int num_stations_per_day, int init_value);
-  vector<int> queryTickets(int bucketID);
-  vector<int> queryTickets(int bucketID, int offset, int num_elements);
-  void updateTickets(int bucketID, const vector<int> &tickets);
-  void updateTickets(int bucketID, int offset, int num_elements,
-                     const vector<int> &tickets);
+  ~TicketBucketManager() { flush(); }
+
+  /**
+   * @brief Pin the row of a sale day, loading it if needed.
+   * @note The row is used in place until the matching unpinRow(), and at most
+   * one row may be pinned at a time.
+   */
+  SeatRow pinRow(int bucketID, int day, int segments);
+  void unpinRow(int bucketID, int day, int segments, bool dirty);
+
+  /**
+   * @brief Rows pinned so far, and how many of them were already cached.
+   */
+  size_t rowReads() const { return reads; }
+  size_t rowHits() const { return hits; }
+
+  int addTickets(int num_days, int segments, int init_value);
+  int minTickets(int bucketID, int day, int segments, int from, int to);
+  vector<int> queryTickets(int bucketID, int day, int segments);
+  /**
+   * @return false, changing nothing, if a segment would go below zero.
+   */
+  bool addTickets(int bucketID, int day, int segments, int from, int to,
+                  int delta);
+  /**
+   * @brief Take the seats of each request in turn with the row pinned once,
+   * skipping those that no longer fit.
+   * @return indices of the requests that got their seats.
+   */
+  vector<int> takeTickets(int bucketID, int day, int segments,
+                          const vector<SeatRequest> &requests);
+
+  /**
+   * @brief Write every dirty row back to the file.
+   */
+  void flush() { rows.flush(); }
+  void sync() {
+    flush();
+    ticketBucket.sync();
+  }
 };
 
 struct Train {
@@ -87,6 +325,334 @@ struct Train {
   bool operator<(const Train &other) const { return trainID < other.trainID; }
 };
 
+/**
+ * @brief Decoded trains and their stations, keyed by hashed train ID.
+ * @note Open addressing with linear probing over a power-of-two table, and the
+ * station blocks, attached only when a caller needs them, back to back in one
+ * arena. Pointers it hands out stay valid until the next insert() or
+ * attachStations(). Once either would outgrow its budget the whole catalog is
+ * dropped and refilled on demand.
+ */
+class TrainCatalog {
+public:
+  struct Entry {
+    size_t hashedID;
+    Train train;
+    int firstStation; // word of its block in the arena, -1 until attached
+  };
+
+  static constexpr size_t ENTRY_BUDGET = 1 << 16;
+  static constexpr size_t ARENA_BUDGET = 1 << 21; // words, 16 MiB
+
+  TrainCatalog() { clear(); }
+
+  const Entry *find(size_t hashedID) const {
+    for (size_t i = home(hashedID);; i = (i + 1) & mask) {
+      if (slots[i] == -1) {
+        return nullptr;
+      }
+      if (keys[i] == hashedID) {
+        return &entries[slots[i]];
+      }
+    }
+  }
+
+  StationRun stations(const Entry *entry) const {
+    return StationRun(&arena[entry->firstStation], entry->train.stationNum);
+  }
+
+  const Entry *insert(size_t hashedID, const Train &train) {
+    if (entries.size() >= ENTRY_BUDGET) {
+      clear();
+    }
+    if ((used + 1) * 2 > keys.size()) {
+      grow();
+    }
+    size_t i = home(hashedID);
+    while (slots[i] != -1) {
+      i = (i + 1) & mask;
+    }
+    keys[i] = hashedID;
+    slots[i] = entries.size();
+    used++;
+    entries.push_back(Entry{hashedID, train, -1});
+    return &entries[slots[i]];
+  }
+
+  /**
+   * @return entry, or where it moved if making room dropped the catalog.
+   */
+  const Entry *attachStations(const Entry *entry,
+                              const vector<size_t> &block) {
+    if (arena.size() + block.size() > ARENA_BUDGET) {
+      Entry kept = *entry;
+      clear();
+      entry = insert(kept.hashedID, kept.train);
+    }
+    Entry &target = entries[entry - &entries[0]];
+    target.firstStation = arena.size();
+    for (size_t j = 0; j < block.size(); ++j) {
+      arena.push_back(block[j]);
+    }
+    return &target;
+  }
+
+  /**
+   * @brief Forget hashedID; its space is reclaimed by the next clear().
+   */
+  void erase(size_t hashedID) {
+    size_t i = home(hashedID);
+    while (slots[i] != -1 && keys[i] != hashedID) {
+      i = (i + 1) & mask;
+    }
+    if (slots[i] == -1) {
+      return;
+    }
+    // Backward shift: pull later members of the cluster into the hole when
+    // their home does not lie between the hole and them.
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; slots[j] != -1; j = (j + 1) & mask) {
+      size_t h = home(keys[j]);
+      if (((j - h) & mask) >= ((j - hole) & mask)) {
+        keys[hole] = keys[j];
+        slots[hole] = slots[j];
+        hole = j;
+      }
+    }
+    slots[hole] = -1;
+    used--;
+  }
+
+  void clear() {
+    keys.assign(MIN_SLOTS, 0);
+    slots.assign(MIN_SLOTS, -1);
+    mask = MIN_SLOTS - 1;
+    shift = 64 - MIN_SLOT_BITS;
+    used = 0;
+    entries.clear();
+    arena.clear();
+  }
+
+private:
+  static constexpr int MIN_SLOT_BITS = 6;
+  static constexpr size_t MIN_SLOTS = size_t(1) << MIN_SLOT_BITS;
+
+  vector<size_t> keys;
+  vector<int> slots; // index into entries, -1 when free
+  size_t mask;
+  int shift; // 64 - log2(slot count)
+  size_t used;
+  vector<Entry> entries;
+  vector<size_t> arena;
+
+  size_t home(size_t hashedID) const {
+    // Fibonacci hashing, the top bits of the product pick the slot.
+    return (hashedID * 11400714819323198485ull) >> shift;
+  }
+
+  // Double the table, entries keep their indices.
+  void grow() {
+    vector<size_t> oldKeys = keys;
+    vector<int> oldSlots = slots;
+    keys.assign(oldKeys.size() * 2, 0);
+    slots.assign(oldKeys.size() * 2, -1);
+    mask = keys.size() - 1;
+    shift--;
+    for (size_t i = 0; i < oldKeys.size(); ++i) {
+      if (oldSlots[i] == -1) {
+        continue;
+      }
+      size_t j = home(oldKeys[i]);
+      while (slots[j] != -1) {
+        j = (j + 1) & mask;
+      }
+      keys[j] = oldKeys[i];
+      slots[j] = oldSlots[i];
+    }
+  }
+};
+
+/**
+ * @brief A train serving a (from, to) station pair, as ticketLookupDB stores
+ * it: what querySingle needs from the train's stations, worked out on release.
+ */
+struct TicketPosting {
+  size_t hashedTrainID;
+  int fromIdx;       // 0-based index
+  int toIdx;         // 0-based index
+  int price;         // from fromIdx to toIdx
+  int leavingOffset; // minutes after the start until leaving fromIdx
+  int arrivalOffset; // minutes after the start until arriving at toIdx
+
+  bool operator==(const TicketPosting &other) const {
+    return hashedTrainID == other.hashedTrainID;
+  }
+
+  bool operator<=(const TicketPosting &other) const {
+    return hashedTrainID <= other.hashedTrainID;
+  }
+
+  bool operator>(const TicketPosting &other) const {
+    return hashedTrainID > other.hashedTrainID;
+  }
+
+  bool operator<(const TicketPosting &other) const {
+    return hashedTrainID < other.hashedTrainID;
+  }
+};
+
+/**
+ * @brief Where a train stops at a station, as stationStopDB stores it under
+ * (station, train).
+ */
+struct StationStop {
+  int index;         // 0-based index
+  int priceSum;      // fare from the train's first station
+  int arrivalOffset; // minutes after the start, -1 at the first station
+  int leavingOffset; // minutes after the start, -1 at the last station
+
+  bool operator==(const StationStop &other) const {
+    return index == other.index;
+  }
+
+  bool operator<=(const StationStop &other) const {
+    return index <= other.index;
+  }
+
+  bool operator>(const StationStop &other) const {
+    return index > other.index;
+  }
+
+  bool operator<(const StationStop &other) const {
+    return index < other.index;
+  }
+};
+
+/**
+ * @brief How querySingle finds the trains that serve a (from, to) pair.
+ */
+enum class QueryEngine {
+  // ticketLookupDB: a posting for every ordered station pair of a train,
+  // O(stationNum^2) inserts per release and one lookup per query.
+  PairIndex,
+  // stationStopDB: one stop per station of a train, the from and to lists are
+  // merge-joined on the train hash per query.
+  StationPostings,
+};
+
+/**
+ * @brief One leg of a transfer: a posting on one of the trains a query loaded,
+ * and the hash of the station the two legs meet at.
+ */
+struct TransferLeg {
+  size_t station;
+  int train; // index into the trains the query loaded
+  TicketPosting posting;
+};
+
+/**
+ * @brief Second legs of a transfer query by the station they leave from, built
+ * once per query and probed with every first leg.
+ * @note Open addressing over station hashes as in TrainCatalog; the legs of a
+ * station are chained in the order they were added, and their group keeps the
+ * bounds queryTransfer prunes with.
+ */
+class TransferLegIndex {
+public:
+  struct Group {
+    int first;    // first leg of the chain, -1 when the slot is free
+    int count;    // legs in the chain
+    int minPrice; // cheapest leg
+    int minRide;  // shortest leg, from leaving to arriving
+  };
+
+  void add(const TransferLeg &leg) { legs.push_back(leg); }
+
+  /**
+   * @brief Hash the legs added so far, call once before probing.
+   */
+  void build() {
+    int bits = 2;
+    while ((size_t(1) << bits) < legs.size() * 2) {
+      bits++;
+    }
+    keys.assign(size_t(1) << bits, 0);
+    groups.assign(size_t(1) << bits, Group{-1, 0, 0, 0});
+    links.assign(legs.size(), -1);
+    mask = keys.size() - 1;
+    shift = 64 - bits;
+    for (int i = legs.size() - 1; i >= 0; --i) {
+      const TicketPosting &posting = legs[i].posting;
+      int ride = posting.arrivalOffset - posting.leavingOffset;
+      size_t j = home(legs[i].station);
+      while (groups[j].first != -1 && keys[j] != legs[i].station) {
+        j = (j + 1) & mask;
+      }
+      Group &group = groups[j];
+      if (group.first == -1) {
+        keys[j] = legs[i].station;
+        group = Group{-1, 0, posting.price, ride};
+      }
+      links[i] = group.first;
+      group.first = i;
+      group.count++;
+      group.minPrice = std::min(group.minPrice, posting.price);
+      group.minRide = std::min(group.minRide, ride);
+    }
+  }
+
+  /**
+   * @return the legs from station, nullptr if there are none.
+   */
+  const Group *find(size_t station) const {
+    for (size_t j = home(station);; j = (j + 1) & mask) {
+      if (groups[j].first == -1) {
+        return nullptr;
+      }
+      if (keys[j] == station) {
+        return &groups[j];
+      }
+    }
+  }
+
+  int next(int leg) const { return links[leg]; }
+
+  const TransferLeg &leg(int i) const { return legs[i]; }
+
+private:
+  vector<TransferLeg> legs;
+  vector<int> links; // next leg from the same station, -1 at the end
+  vector<size_t> keys;
+  vector<Group> groups;
+  size_t mask;
+  int shift;
+
+  size_t home(size_t station) const {
+    return (station * 11400714819323198485ull) >> shift;
+  }
+};
+
+/**
+ * @brief Trains and seat rows looked up, and how many of them were already in
+ * memory: trains with their stations in the catalog, rows in the row cache.
+ */
+struct LookupStats {
+  size_t trains;
+  size_t trainHits;
+  size_t seatRows;
+  size_t seatRowHits;
+};
+
+/**
+ * @brief How much of its join the last query_transfer scored.
+ */
+struct TransferStats {
+  size_t pairs;        // first and second legs that meet at a station
+  size_t evaluated;    // pairs scored
+  size_t pruned;       // pairs a bound ruled out unscored
+  LookupStats lookups; // made by the query
+};
+
 struct CustomStringHasher {
   size_t operator()(const char *str) const {
     size_t hash = 5381;
@@ -137,16 +703,35 @@ class TrainManager {
 
 private:
   BPTStorage<size_t, Train, 500, 30> trainDB; // hashedID -> Train
-  BPTStorage<std::pair<size_t, size_t>, size_t, 250, 500>
-      ticketLookupDB; // stationName, stationName -> hashedID
+  BPTStorage<std::pair<size_t, size_t>, TicketPosting, 250, 200>
+      ticketLookupDB; // stationName, stationName -> posting
+  BPTStorage<std::pair<size_t, size_t>, StationStop, 250, 300>
+      stationStopDB; // stationName, hashedID -> stop
   BPTStorage<size_t, size_t, 500, 500>
       transferLookupDB; // fromStation -> hashedID
-  StationBucketManager stationBucketManager;
+  StationBucketManager<> stationBucketManager;
   TicketBucketManager ticketBucketManager;
+  TrainCatalog catalog; // hashedID -> Train and stations, filled lazily
   CustomStringHasher stringHasher;
+  QueryEngine engine;
+  TransferStats lastTransfer = TransferStats{0, 0, 0, LookupStats{0, 0, 0, 0}};
+  size_t trainLookups = 0, trainHits = 0; // of getTrain()
+
+  // Trains and index entries not yet in the trees, see applyBulkLoad().
+  bool bulkLoading = false;
+  sjtu::map<size_t, Train> bulkTrains;
+  vector<std::pair<std::pair<size_t, size_t>, TicketPosting>> bulkPostings;
+  vector<std::pair<std::pair<size_t, size_t>, StationStop>> bulkStops;
+  vector<std::pair<size_t, size_t>> bulkTransfers;
 
 public:
-  TrainManager(const std::string &trainFile);
+  /**
+   * @param engine index that releaseTrain builds and querySingle reads. It is
+   * part of the data files, so it must not change between runs on them.
+   */
+  TrainManager(const std::string &trainFile,
+               QueryEngine engine = QueryEngine::StationPostings);
+  ~TrainManager() { endBulkLoad(); }
 
   int addTrain(const string32 &trainID, int stationNum_val, int seatNum_val,
                const std::string &stations_str,      // -s ("s1|s2|s3")
@@ -170,7 +755,56 @@ public:
                             const string32 &date_s32,
                             const std::string &sortBy = "time");
 
+  /**
+   * @brief Collect what addTrain and releaseTrain write to the trees until
+   * endBulkLoad(), which sorts it and builds the trees from it bottom-up.
+   * @note Only addTrain and releaseTrain may be called in between.
+   */
+  void beginBulkLoad() { bulkLoading = true; }
+  void endBulkLoad() {
+    bulkLoading = false;
+    applyBulkLoad();
+  }
+
+  /**
+   * @brief Join counters of the last queryTransfer call.
+   */
+  const TransferStats &transferStats() const { return lastTransfer; }
+
+  /**
+   * @brief Lookups made since the TrainManager opened.
+   */
+  LookupStats lookupStats() const {
+    return LookupStats{trainLookups, trainHits, ticketBucketManager.rowReads(),
+                       ticketBucketManager.rowHits()};
+  }
+
+  /**
+   * @brief Write dirty pages back; with durable set, also fsync every file.
+   */
+  void flush(bool durable = false);
+
+  /**
+   * @brief Rewrite the train and lookup trees without their freed pages, and
+   * the station runs without those of deleted trains.
+   */
+  void compact();
+
 private:
+  /**
+   * @brief Look a train up in the catalog, loading it from trainDB on a miss.
+   * @param withStations also load its stations into the catalog.
+   * @return nullptr if there is no such train. Valid until the next load.
+   */
+  const TrainCatalog::Entry *getTrain(size_t hashedID,
+                                      bool withStations = false);
+
+  /**
+   * @brief Trains that serve from before to, by train hash, from the index
+   * the engine keeps.
+   */
+  vector<TicketPosting> findPostings(size_t hashedFrom, size_t hashedTo);
+
   /**
    * @brief Buy tickets for a specific train.
    * @return A pair of integers: the total price and the departure date of
@@ -180,100 +814,226 @@ private:
   buyTicket(const string32 &trainID, const DateTime &departureDate, int num,
             const string32 &from, const string32 &to);
 
-  bool refundTicket(const string32 &trainID, const DateTime &departureDate,
+  bool refundTicket(const size_t hashedTrainID, const DateTime &departureDate,
                     int num, const int from_idx, const int to_idx);
 
-  vector<int> queryLeftSeats(const size_t hashedTrainID, DateTime date,
-                             const int from_station_idx,
-                             const int to_station_idx);
+  /**
+   * @return fewest seats left between the two stations on the run that starts
+   * on date, INT_MAX if that run is not on sale.
+   */
+  int queryLeftSeats(const size_t hashedTrainID, DateTime date,
+                     const int from_station_idx, const int to_station_idx);
+  int queryLeftSeats(const Train &train, DateTime date,
+                     const int from_station_idx, const int to_station_idx);
 
-  bool updateLeftSeats(const string32 &trainID, DateTime date,
+  /**
+   * @return seats left on each segment of the run that starts on date.
+   */
+  vector<int> queryLeftSeats(const size_t hashedTrainID, DateTime date);
+
+  bool updateLeftSeats(const size_t hashedTrainID, DateTime date,
                        const int from_station_idx, const int to_station_idx,
                        int num);
 
+  /**
+   * @brief Serve requests in turn on the run that starts on date, skipping
+   * those that do not fit, in one pass over its seat row.
+   * @return indices of the requests that got their seats.
+   */
+  vector<int> takeSeats(const size_t hashedTrainID, DateTime date,
+                        const vector<SeatRequest> &requests);
+
   vector<TicketCandidate> querySingle(const string32 &from, const string32 &to,
                                       const DateTime &date,
-                                      const std::string &sortBy = "time",
-                                      bool isTransfer = false);
+                                      const std::string &sortBy = "time");
+
+  /**
+   * @brief Start date of the first run of train that leaves the station at
+   * leavingOffset no earlier than arrival.
+   * @return false if no run on sale does.
+   */
+  bool transferStartDate(const Train &train, int leavingOffset,
+                         const DateTime &arrival, DateTime &startDate) const;
+
+  /**
+   * @brief Insert the collected trains and index entries into their trees
+   * with insert_sorted(), so that a large batch rebuilds them.
+   */
+  void applyBulkLoad();
 };
 
-int StationBucketManager::addStations(vector<Station> &stations) {
-  if (stations.empty()) {
+// Collected index entries that make a bulk load apply early, to bound memory.
+constexpr size_t BULK_LOAD_ENTRIES = 1 << 22;
+
+template <class File>
+int StationBucketManager<File>::addStations(const vector<size_t> &hashes,
+                                            const vector<int> &priceSums,
+                                            const vector<int> &arrivals,
+                                            const vector<int> &leavings,
+                                            const vector<string32> &names) {
+  int num = hashes.size();
+  if (num == 0) {
     ERROR("addStations: empty stations vector");
     return -1;
   }
-  int bucketID = stationBucket.write(stations[0]);
-  for (size_t i = 1; i < stations.size(); ++i) {
-    stationBucket.write(stations[i]);
-  }
-  LOG("Added " + std::to_string(stations.size()) +
+  vector<size_t> block(StationRun::words(num), 0);
+  char *column = reinterpret_cast<char *>(block.data());
+  auto put = [&column](const void *src, size_t bytes) {
+    std::memcpy(column, src, bytes);
+    column += bytes;
+  };
+  put(hashes.data(), num * sizeof(size_t));
+  put(priceSums.data(), num * sizeof(int));
+  put(arrivals.data(), num * sizeof(int));
+  put(leavings.data(), num * sizeof(int));
+  put(names.data(), num * sizeof(string32));
+  int bucketID =
+      stationBucket.append(block.data(), block.size() * sizeof(size_t));
+  LOG("Added " + std::to_string(num) +
       " stations with bucket ID: " + std::to_string(bucketID));
   return bucketID;
 }
 
-bool StationBucketManager::deleteStations(int bucketID, int num) {
-  for (int i = 0; i < num; ++i) {
-    stationBucket.remove(bucketID + i * sizeof(Station));
-  }
-  LOG("Deleted " + std::to_string(num) +
+template <class File>
+vector<size_t> StationBucketManager<File>::queryStations(int bucketID,
+                                                        int num) {
+  vector<size_t> block(StationRun::words(num), 0);
+  stationBucket.read(bucketID, block.data(), block.size() * sizeof(size_t));
+  LOG("Queried " + std::to_string(num) +
       " stations from bucket ID: " + std::to_string(bucketID));
-  return true;
+  return block;
 }
 
-vector<Station> StationBucketManager::queryStations(int bucketID, int num) {
-  vector<Station> stations_vec;
-  for (int i = 0; i < num; ++i) {
-    Station station;
-    stationBucket.read(station, bucketID + i * sizeof(Station));
-    stations_vec.push_back(station);
+template <class File>
+vector<int>
+StationBucketManager<File>::compact(const vector<std::pair<int, int>> &runs) {
+  std::string denseName = fileName + ".compact";
+  std::remove(denseName.c_str());
+  vector<int> moved;
+  {
+    File dense;
+    dense.open(denseName);
+    for (const std::pair<int, int> &run : runs) {
+      vector<size_t> block = queryStations(run.first, run.second);
+      moved.push_back(
+          dense.append(block.data(), block.size() * sizeof(size_t)));
+    }
+    dense.sync();
   }
-  LOG("Queried " + std::to_string(num) +
-      " stations from bucket ID: " + std::to_string(bucketID));
-  return stations_vec;
+  stationBucket.close();
+  std::rename(denseName.c_str(), fileName.c_str());
+  stationBucket.open(fileName);
+  LOG("Compacted " + std::to_string(runs.size()) + " station runs");
+  return moved;
 }
 
-int TicketBucketManager::addTickets(int num_days, int num_stations_per_day,
+int TicketBucketManager::addTickets(int num_days, int segments,
                                     int init_value) {
-  int bucketID =
-      ticketBucket.write(init_value, num_days * num_stations_per_day);
+  int size = SeatRow::size(segments);
+  vector<int> rows(num_days * size, 0);
+  for (int day = 0; day < num_days; ++day) {
+    SeatRow::init(rows.data() + day * size, segments, init_value);
+  }
+  int bucketID = ticketBucket.write(rows.data(), rows.size());
   LOG("Added tickets: " + std::to_string(num_days) + " days, " +
-      std::to_string(num_stations_per_day) +
-      " stations per day, bucket ID: " + std::to_string(bucketID));
+      std::to_string(segments) +
+      " segments per day, bucket ID: " + std::to_string(bucketID));
   return bucketID;
 }
 
-vector<int> TicketBucketManager::queryTickets(int bucketID) {
-  LOG("Querying all tickets from bucket ID: " + std::to_string(bucketID));
-  return ticketBucket.read(bucketID);
+SeatRow TicketBucketManager::pinRow(int bucketID, int day, int segments) {
+  int size = SeatRow::size(segments);
+  reads++;
+  spilled = false;
+  Frame *frame = nullptr;
+  if (segments <= MAX_SEGMENTS) {
+    int key = offset(bucketID, day, segments);
+    frame = rows.pin(key);
+    if (frame != nullptr) {
+      hits++;
+    } else {
+      Frame loaded;
+      loaded.bucketID = bucketID;
+      loaded.day = day;
+      loaded.segments = segments;
+      vector<int> row = ticketBucket.read(bucketID, day * size, size);
+      std::memcpy(loaded.row, row.data(), size * sizeof(int));
+      if (rows.put(key, loaded, false)) {
+        frame = rows.pin(key);
+      }
+    }
+  }
+  if (frame == nullptr) {
+    // Too long for a frame, or every frame is pinned: go to the file.
+    spilled = true;
+    spill = ticketBucket.read(bucketID, day * size, size);
+    return SeatRow(spill.data(), segments);
+  }
+  return SeatRow(frame->row, segments);
 }
-vector<int> TicketBucketManager::queryTickets(int bucketID, int offset,
-                                              int num_elements) {
-  LOG("Querying " + std::to_string(num_elements) + " tickets from bucket ID: " +
-      std::to_string(bucketID) + " offset: " + std::to_string(offset));
-  return ticketBucket.read(bucketID, offset, num_elements);
+
+void TicketBucketManager::unpinRow(int bucketID, int day, int segments,
+                                   bool dirty) {
+  if (spilled) {
+    if (dirty) {
+      writeDay(bucketID, day, segments, spill.data());
+    }
+    return;
+  }
+  rows.unpin(offset(bucketID, day, segments), dirty);
 }
 
-void TicketBucketManager::updateTickets(int bucketID,
-                                        const vector<int> &tickets) {
-  LOG("Updating all tickets in bucket ID: " + std::to_string(bucketID));
-  return ticketBucket.update(bucketID, tickets);
+int TicketBucketManager::minTickets(int bucketID, int day, int segments,
+                                    int from, int to) {
+  int left = pinRow(bucketID, day, segments).min(from, to);
+  unpinRow(bucketID, day, segments, false);
+  return left;
 }
 
-void TicketBucketManager::updateTickets(int bucketID, int offset,
-                                        int num_elements,
-                                        const vector<int> &tickets) {
-  LOG("Updating " + std::to_string(num_elements) + " tickets in bucket ID: " +
-      std::to_string(bucketID) + " offset: " + std::to_string(offset));
-  return ticketBucket.update(bucketID, offset, num_elements, tickets);
+vector<int> TicketBucketManager::queryTickets(int bucketID, int day,
+                                              int segments) {
+  LOG("Querying all tickets from bucket ID: " + std::to_string(bucketID));
+  vector<int> left = pinRow(bucketID, day, segments).values();
+  unpinRow(bucketID, day, segments, false);
+  return left;
+}
+
+bool TicketBucketManager::addTickets(int bucketID, int day, int segments,
+                                     int from, int to, int delta) {
+  SeatRow seats = pinRow(bucketID, day, segments);
+  bool enough = seats.min(from, to) + delta >= 0;
+  if (enough) {
+    seats.add(from, to, delta);
+  }
+  unpinRow(bucketID, day, segments, enough);
+  return enough;
 }
 
-TrainManager::TrainManager(const std::string &trainFile)
+vector<int>
+TicketBucketManager::takeTickets(int bucketID, int day, int segments,
+                                 const vector<SeatRequest> &requests) {
+  vector<int> taken;
+  SeatRow seats = pinRow(bucketID, day, segments);
+  for (size_t i = 0; i < requests.size(); ++i) {
+    const SeatRequest &request = requests[i];
+    if (seats.min(request.from, request.to) >= request.num) {
+      seats.add(request.from, request.to, -request.num);
+      taken.push_back(i);
+    }
+  }
+  unpinRow(bucketID, day, segments, !taken.empty());
+  return taken;
+}
+
+TrainManager::TrainManager(const std::string &trainFile, QueryEngine engine)
     : trainDB(trainFile + "_train", ULONG_MAX),
       ticketLookupDB(trainFile + "_ticket_lookup",
                      std::make_pair(ULONG_MAX, ULONG_MAX)),
+      stationStopDB(trainFile + "_station_stop",
+                    std::make_pair(ULONG_MAX, ULONG_MAX)),
       transferLookupDB(trainFile + "_transfer_lookup", ULONG_MAX),
       stationBucketManager(trainFile + "_station_bucket"),
-      ticketBucketManager(trainFile + "_ticket_bucket") {
+      ticketBucketManager(trainFile + "_ticket_bucket"), engine(engine) {
   LOG("TrainManager initialized with file prefix: " + trainFile);
 }
 
@@ -286,7 +1046,7 @@ int TrainManager::addTrain(const string32 &trainID, int stationNum_val,
                            const std::string &saleDates_str, char trainType) {
   LOG("Adding train: " + trainID.toString());
 
-  if (!trainDB.find(stringHasher(trainID.c_str())).empty()) {
+  if (getTrain(stringHasher(trainID.c_str())) != nullptr) {
     ERROR("Train ID already exists: " + trainID.toString());
     return -1; // Train ID already exists
   }
@@ -340,39 +1100,31 @@ int TrainManager::addTrain(const string32 &trainID, int stationNum_val,
     return -1; // For 2 stations, stopover times should be empty if not "_"
   }
 
-  vector<Station> stationData;
+  vector<size_t> hashes;
+  vector<int> priceSums, arrivals, leavings;
   int currentRelativeTime = 0;
 
   for (int i = 0; i < stationNum_val; ++i) {
-    Station s;
-    s.name = stationNames[i];
-    s.index = i;
-
+    hashes.push_back(stringHasher(stationNames[i].c_str()));
     if (i == 0) {
-      s.isStart = true;
-      s.isEnd = false;
-      s.arrivalTimeOffset = -1;
-      s.leavingTimeOffset = 0;
-      s.price = 0;
-      currentRelativeTime = 0;
-    } else {
-      s.isStart = false;
-      currentRelativeTime += travelTimesMinutes[i - 1];
-      s.arrivalTimeOffset = currentRelativeTime;
-      s.price = prices[i - 1];
-      if (i == stationNum_val - 1) { // End station
-        s.isEnd = true;
-        s.leavingTimeOffset = -1; // No departure from end
-      } else {                    // Intermediate station
-        s.isEnd = false;
-        currentRelativeTime += stopoverTimesMinutes[i - 1];
-        s.leavingTimeOffset = currentRelativeTime;
-      }
+      priceSums.push_back(0);
+      arrivals.push_back(-1);
+      leavings.push_back(0);
+      continue;
+    }
+    priceSums.push_back(priceSums[i - 1] + prices[i - 1]);
+    currentRelativeTime += travelTimesMinutes[i - 1];
+    arrivals.push_back(currentRelativeTime);
+    if (i == stationNum_val - 1) { // End station
+      leavings.push_back(-1);      // No departure from end
+    } else {                       // Intermediate station
+      currentRelativeTime += stopoverTimesMinutes[i - 1];
+      leavings.push_back(currentRelativeTime);
     }
-    stationData.push_back(s);
   }
 
-  int station_bID = stationBucketManager.addStations(stationData);
+  int station_bID = stationBucketManager.addStations(
+      hashes, priceSums, arrivals, leavings, stationNames);
   if (station_bID == -1) {
     ERROR("Failed to add stations for train: " + trainID.toString());
     return -1;
@@ -390,7 +1142,10 @@ int TrainManager::addTrain(const string32 &trainID, int stationNum_val,
   newTrain.type = trainType;
   newTrain.isReleased = false;
 
-  trainDB.insert(stringHasher(trainID.c_str()), newTrain);
+  bulkTrains[stringHasher(trainID.c_str())] = newTrain;
+  if (!bulkLoading) {
+    applyBulkLoad();
+  }
   LOG("Successfully added train: " + trainID.toString() + " with " +
       std::to_string(stationNum_val) + " stations and " +
       std::to_string(seatNum_val) + " seats, starting at " +
@@ -402,20 +1157,20 @@ int TrainManager::addTrain(const string32 &trainID, int stationNum_val,
 int TrainManager::deleteTrain(const string32 &trainID) {
   LOG("Deleting train: " + trainID.toString());
 
-  auto foundTrains = trainDB.find(stringHasher(trainID.c_str()));
-  if (foundTrains.empty()) {
+  const TrainCatalog::Entry *entry = getTrain(stringHasher(trainID.c_str()));
+  if (entry == nullptr) {
     ERROR("Train not found for deletion: " + trainID.toString());
     return -1;
   }
-  Train trainToDelete = foundTrains[0];
+  Train trainToDelete = entry->train;
   if (trainToDelete.isReleased) {
     ERROR("Cannot delete released train: " + trainID.toString());
     return -1; // Cannot delete a released train
   }
 
   trainDB.remove(stringHasher(trainID.c_str()), trainToDelete);
-  stationBucketManager.deleteStations(trainToDelete.stationBucketID,
-                                      trainToDelete.stationNum);
+  catalog.erase(stringHasher(trainID.c_str()));
+  // Its station run stays in the file until compact() drops it.
   LOG("Successfully deleted train: " + trainID.toString());
   return 0;
 }
@@ -423,18 +1178,18 @@ int TrainManager::deleteTrain(const string32 &trainID) {
 int TrainManager::releaseTrain(const string32 &trainID) {
   LOG("Releasing train: " + trainID.toString());
 
-  auto foundTrains = trainDB.find(stringHasher(trainID.c_str()));
-  if (foundTrains.empty()) {
+  const TrainCatalog::Entry *entry =
+      getTrain(stringHasher(trainID.c_str()), true);
+  if (entry == nullptr) {
     ERROR("Train not found for release: " + trainID.toString());
     return -1; // Train not found
   }
-  Train trainToRelease = foundTrains[0];
+  Train trainToRelease = entry->train;
   if (trainToRelease.isReleased) {
     ERROR("Train already released: " + trainID.toString());
     return -1; // Already released
   }
 
-  trainDB.remove(stringHasher(trainID.c_str()), trainToRelease);
   trainToRelease.isReleased = true;
   int numSaleDays = calcDateDuration(trainToRelease.saleStartDate.getDateMMDD(),
                                      trainToRelease.saleEndDate.getDateMMDD()) +
@@ -448,26 +1203,38 @@ int TrainManager::releaseTrain(const string32 &trainID) {
     return -1;
   }
 
-  auto stations = stationBucketManager.queryStations(
-      trainToRelease.stationBucketID, trainToRelease.stationNum);
-
-  size_t hashedStation[trainToRelease.stationNum];
-  for (int i = 0; i < trainToRelease.stationNum; ++i) {
-    hashedStation[i] = stringHasher(stations[i].name.c_str());
-  }
-
+  StationRun stations = catalog.stations(entry);
   size_t hashedTrainID = stringHasher(trainID.c_str());
 
   for (int i = 0; i < trainToRelease.stationNum; ++i) {
-    for (int j = i + 1; j < trainToRelease.stationNum; ++j) {
-      ticketLookupDB.insert(std::make_pair(hashedStation[i], hashedStation[j]),
-                            hashedTrainID); // from, to -> trainID
+    if (engine == QueryEngine::PairIndex) {
+      for (int j = i + 1; j < trainToRelease.stationNum; ++j) {
+        TicketPosting posting{hashedTrainID, i, j, stations.price(i, j),
+                              stations.leavings[i], stations.arrivals[j]};
+        bulkPostings.push_back(
+            {std::make_pair(stations.hashes[i], stations.hashes[j]),
+             posting}); // from, to -> train
+      }
+    } else {
+      StationStop stop{i, stations.priceSums[i], stations.arrivals[i],
+                       stations.leavings[i]};
+      bulkStops.push_back(
+          {std::make_pair(stations.hashes[i], hashedTrainID), stop});
     }
-    transferLookupDB.insert(hashedStation[i], hashedTrainID);
+    bulkTransfers.push_back({stations.hashes[i], hashedTrainID});
   }
 
   trainToRelease.ticketBucketID = ticket_bID;
-  trainDB.insert(hashedTrainID, trainToRelease);
+  if (bulkTrains.count(hashedTrainID) == 0) {
+    trainDB.remove(hashedTrainID, trainToRelease);
+  }
+  bulkTrains[hashedTrainID] = trainToRelease;
+  catalog.erase(hashedTrainID);
+  size_t collected =
+      bulkPostings.size() + bulkStops.size() + bulkTransfers.size();
+  if (!bulkLoading || collected > BULK_LOAD_ENTRIES) {
+    applyBulkLoad();
+  }
 
   LOG("Successfully released train: " + trainID.toString() + " with " +
       std::to_string(numSaleDays) + " sale days");
@@ -485,12 +1252,13 @@ std::string TrainManager::queryTrain(const string32 &trainID,
     return "-1"; // Invalid date format
   }
 
-  auto foundTrains = trainDB.find(stringHasher(trainID.c_str()));
-  if (foundTrains.empty()) {
+  const TrainCatalog::Entry *entry =
+      getTrain(stringHasher(trainID.c_str()), true);
+  if (entry == nullptr) {
     ERROR("Train not found for query: " + trainID.toString());
     return "-1"; // Train not found
   }
-  Train train = foundTrains[0];
+  const Train &train = entry->train;
 
   if (queryDate.getDateMMDD() < train.saleStartDate.getDateMMDD() ||
       queryDate.getDateMMDD() > train.saleEndDate.getDateMMDD()) {
@@ -502,10 +1270,7 @@ std::string TrainManager::queryTrain(const string32 &trainID,
   std::ostringstream oss;
   oss << train.trainID.toString() << " " << train.type << "\n";
 
-  vector<Station> stations = stationBucketManager.queryStations(
-      train.stationBucketID, train.stationNum);
-
-  int cumulativePrice = 0;
+  StationRun stations = catalog.stations(entry);
 
   // Base departure DateTime: queryDate + train's startTime
   DateTime baseDepartureDateTime(queryDate.getDateMMDD(),
@@ -513,38 +1278,35 @@ std::string TrainManager::queryTrain(const string32 &trainID,
 
   vector<int> dailyLeftSeats;
   if (train.isReleased) {
-    dailyLeftSeats = queryLeftSeats(stringHasher(trainID.c_str()), queryDate, 0,
-                                    train.stationNum - 1);
+    dailyLeftSeats = queryLeftSeats(stringHasher(trainID.c_str()), queryDate);
   }
 
   for (int i = 0; i < train.stationNum; ++i) {
-    const Station &s = stations[i];
+    bool isEnd = i == train.stationNum - 1;
     std::string arrivalTimeStr, leavingTimeStr;
 
-    if (s.isStart) {
+    if (i == 0) {
       arrivalTimeStr = "xx-xx xx:xx";
       DateTime leavingDateTime = baseDepartureDateTime; // No offset
       leavingTimeStr = leavingDateTime.toString();
-      cumulativePrice = 0;
     } else {
       DateTime arrivalDateTime = baseDepartureDateTime;
-      arrivalDateTime.addDuration(s.arrivalTimeOffset);
+      arrivalDateTime.addDuration(stations.arrivals[i]);
       arrivalTimeStr = arrivalDateTime.toString();
-      cumulativePrice += s.price; // s.price is price from previous to current
 
-      if (s.isEnd) {
+      if (isEnd) {
         leavingTimeStr = "xx-xx xx:xx";
       } else {
         DateTime leavingDateTime = baseDepartureDateTime;
-        leavingDateTime.addDuration(s.leavingTimeOffset);
+        leavingDateTime.addDuration(stations.leavings[i]);
         leavingTimeStr = leavingDateTime.toString();
       }
     }
 
-    oss << s.name.toString() << " " << arrivalTimeStr << " -> "
-        << leavingTimeStr << " " << cumulativePrice << " ";
+    oss << stations.names[i].toString() << " " << arrivalTimeStr << " -> "
+        << leavingTimeStr << " " << stations.priceSums[i] << " ";
 
-    if (s.isEnd) {
+    if (isEnd) {
       oss << "x";
     } else {
       if (train.isReleased) {
@@ -563,110 +1325,95 @@ std::string TrainManager::queryTrain(const string32 &trainID,
   return oss.str();
 }
 
+vector<TicketPosting> TrainManager::findPostings(size_t hashedFrom,
+                                                 size_t hashedTo) {
+  if (engine == QueryEngine::PairIndex) {
+    return ticketLookupDB.find(std::make_pair(hashedFrom, hashedTo));
+  }
+
+  // Both stop lists are sorted by train hash under their station.
+  vector<TicketPosting> postings;
+  auto from = stationStopDB.lower_bound(std::make_pair(hashedFrom, size_t(0)));
+  auto to = stationStopDB.lower_bound(std::make_pair(hashedTo, size_t(0)));
+  while (from.valid() && from.key().first == hashedFrom && to.valid() &&
+         to.key().first == hashedTo) {
+    size_t fromTrain = from.key().second, toTrain = to.key().second;
+    if (fromTrain < toTrain) {
+      from.next();
+    } else if (toTrain < fromTrain) {
+      to.next();
+    } else {
+      const StationStop &a = from.value(), &b = to.value();
+      if (a.index < b.index) {
+        postings.push_back(TicketPosting{fromTrain, a.index, b.index,
+                                         b.priceSum - a.priceSum,
+                                         a.leavingOffset, b.arrivalOffset});
+      }
+      from.next();
+      to.next();
+    }
+  }
+  return postings;
+}
+
 vector<TicketCandidate> TrainManager::querySingle(const string32 &from,
                                                   const string32 &to,
                                                   const DateTime &date,
-                                                  const std::string &sortBy,
-                                                  bool isTransfer) {
+                                                  const std::string &sortBy) {
   LOG("Querying single route from " + from.toString() + " to " + to.toString() +
       " using sortBy: " + sortBy);
-  auto matchingTrainIDs = ticketLookupDB.find(
-      std::make_pair(stringHasher(from.c_str()), stringHasher(to.c_str())));
-  LOG("Found " + std::to_string(matchingTrainIDs.size()) +
+  vector<TicketPosting> postings =
+      findPostings(stringHasher(from.c_str()), stringHasher(to.c_str()));
+  LOG("Found " + std::to_string(postings.size()) +
       " matching trains for route from " + from.toString() + " to " +
       to.toString());
-  if (matchingTrainIDs.empty()) {
+  if (postings.empty()) {
     LOG("No matching trains found for route");
     return vector<TicketCandidate>(); // No matching trains found
   }
   vector<TicketCandidate>
       trainDetails; // trainID, price, from, to, duration, departureDateTime,
                     // endDateTime, seatNum
-  for (const auto &trainID : matchingTrainIDs) {
-    auto foundTrains = trainDB.find(trainID);
-    if (foundTrains.empty() || !foundTrains[0].isReleased) {
+  for (const TicketPosting &posting : postings) {
+    size_t trainID = posting.hashedTrainID;
+    const TrainCatalog::Entry *entry = getTrain(trainID);
+    if (entry == nullptr || !entry->train.isReleased) {
       continue; // Skip unreleased trains
     }
-    Train train = foundTrains[0];
-
-    int from_idx = -1, to_idx = -1;
-    bool flag = false;
-    vector<Station> stations = stationBucketManager.queryStations(
-        train.stationBucketID, train.stationNum);
-    for (int i = 0; i < train.stationNum; ++i) {
-      if (stations[i].name == from) {
-        from_idx = i;
-        flag = true;
-      }
-      if (stations[i].name == to) {
-        to_idx = i;
-        break;
-      }
-    }
-    if (from_idx == -1 || to_idx == -1 || from_idx >= to_idx) {
-      continue; // Invalid station names or indices
-    }
+    const Train &train = entry->train;
+
+    // The posting carries everything needed from the stations.
+    int from_idx = posting.fromIdx, to_idx = posting.toIdx;
 
     DateTime queryDate = date;
-    queryDate.minusDuration((stations[from_idx].leavingTimeOffset +
+    queryDate.minusDuration((posting.leavingOffset +
                              train.startTime.getTimeMinutes()) /
                             1440 * 1440); // Adjust to train's start time
 
-    if (isTransfer) {
-      if (queryDate.getDateMMDD() < train.saleStartDate.getDateMMDD()) {
-        queryDate = train.saleStartDate; // Use sale start date
-      } else if (queryDate.getDateMMDD() > train.saleEndDate.getDateMMDD()) {
-        continue;
-      }
-    } else {
-      if (queryDate.getDateMMDD() < train.saleStartDate.getDateMMDD() ||
-          queryDate.getDateMMDD() > train.saleEndDate.getDateMMDD()) {
-        continue; // Not on sale on this date
-      }
+    if (queryDate.getDateMMDD() < train.saleStartDate.getDateMMDD() ||
+        queryDate.getDateMMDD() > train.saleEndDate.getDateMMDD()) {
+      continue; // Not on sale on this date
     }
 
-    if (isTransfer) {
-      DateTime transferDate =
-          DateTime(queryDate.getDateMMDD(), train.startTime.getTimeMinutes());
-      transferDate.addDuration(stations[from_idx].leavingTimeOffset);
-      while (transferDate < date) {
-        transferDate.addDuration(1440);
-        queryDate.addDuration(1440);
-      }
-      if (queryDate.getDateMMDD() > train.saleEndDate.getDateMMDD()) {
-        continue; // No valid transfer date
-      }
-    }
+    int seatsAvailable = queryLeftSeats(train, queryDate, from_idx, to_idx);
 
-    vector<int> leftSeats =
-        queryLeftSeats(trainID, queryDate, from_idx, to_idx);
-    int seatsAvailable = std::numeric_limits<int>::max();
-    for (int seat : leftSeats) {
-      seatsAvailable = std::min(seatsAvailable, seat);
-    }
-
-    int totalPrice = 0;
-    for (int i = from_idx + 1; i <= to_idx; ++i) {
-      totalPrice += stations[i].price;
-    }
+    int totalPrice = posting.price;
 
-    int duration = stations[to_idx].arrivalTimeOffset -
-                   stations[from_idx].leavingTimeOffset;
+    int duration = posting.arrivalOffset - posting.leavingOffset;
 
     DateTime departureDateTime(queryDate.getDateMMDD(),
                                train.startTime.getTimeMinutes());
-    departureDateTime.addDuration(stations[from_idx].leavingTimeOffset);
+    departureDateTime.addDuration(posting.leavingOffset);
     DateTime endDateTime(queryDate.getDateMMDD(),
                          train.startTime.getTimeMinutes());
-    endDateTime.addDuration(stations[to_idx].arrivalTimeOffset);
+    endDateTime.addDuration(posting.arrivalOffset);
 
-    trainDetails.push_back(TicketCandidate(
-        train.trainID, totalPrice, duration, stations[from_idx].name,
-        stations[to_idx].name, departureDateTime, endDateTime, seatsAvailable));
+    trainDetails.push_back(TicketCandidate(train.trainID, totalPrice, duration,
+                                           from, to, departureDateTime,
+                                           endDateTime, seatsAvailable));
 
     LOG("Found ticket candidate: " + train.trainID.toString() + " from " +
-        stations[from_idx].name.toString() + " to " +
-        stations[to_idx].name.toString() + " on " +
+        from.toString() + " to " + to.toString() + " on " +
         departureDateTime.toString() + " with price " +
         std::to_string(totalPrice) + " and duration " +
         std::to_string(duration) + " minutes");
@@ -720,6 +1467,32 @@ std::string TrainManager::queryTicket(const string32 &from, const string32 &to,
   return oss.str();
 }
 
+bool TrainManager::transferStartDate(const Train &train, int leavingOffset,
+                                     const DateTime &arrival,
+                                     DateTime &startDate) const {
+  DateTime queryDate = arrival;
+  queryDate.minusDuration((leavingOffset + train.startTime.getTimeMinutes()) /
+                          1440 * 1440); // Adjust to train's start time
+  if (queryDate.getDateMMDD() < train.saleStartDate.getDateMMDD()) {
+    queryDate = train.saleStartDate; // Use sale start date
+  } else if (queryDate.getDateMMDD() > train.saleEndDate.getDateMMDD()) {
+    return false;
+  }
+
+  DateTime transferDate(queryDate.getDateMMDD(),
+                        train.startTime.getTimeMinutes());
+  transferDate.addDuration(leavingOffset);
+  while (transferDate < arrival) {
+    transferDate.addDuration(1440);
+    queryDate.addDuration(1440);
+  }
+  if (queryDate.getDateMMDD() > train.saleEndDate.getDateMMDD()) {
+    return false; // No valid transfer date
+  }
+  startDate = DateTime(queryDate.getDateMMDD());
+  return true;
+}
+
 std::string TrainManager::queryTransfer(const string32 &from,
                                         const string32 &to,
                                         const string32 &date_s32,
@@ -727,177 +1500,245 @@ std::string TrainManager::queryTransfer(const string32 &from,
   LOG("Querying transfer from " + from.toString() + " to " + to.toString() +
       " on " + date_s32.toString() + " sorted by " + sortBy);
 
-  TicketCandidate bestLeg1Candidate;
-  TicketCandidate bestLeg2Candidate;
-  bool transferFound = false;
-
-  // Variables for the best option
-  size_t bestTotalPrice = std::numeric_limits<size_t>::max();
-  string32 bestPrice_train1ID_tie = "";
-  string32 bestPrice_train2ID_tie = "";
+  lastTransfer = TransferStats{0, 0, 0, LookupStats{0, 0, 0, 0}};
+  LookupStats before = lookupStats();
+  auto countLookups = [&]() {
+    LookupStats after = lookupStats();
+    lastTransfer.lookups = LookupStats{
+        after.trains - before.trains, after.trainHits - before.trainHits,
+        after.seatRows - before.seatRows,
+        after.seatRowHits - before.seatRowHits};
+  };
+  bool byCost = sortBy == "cost";
+  if (!byCost && sortBy != "time") {
+    return "";
+  }
+  DateTime date(date_s32);
 
-  size_t bestTotalDuration = std::numeric_limits<size_t>::max();
-  string32 bestTime_train1ID_tie = "";
-  string32 bestTime_train2ID_tie = "";
+  // Every train through from or to is loaded once, and copied, as loading the
+  // next one may drop it from the catalog.
+  vector<Train> trains;
+  vector<DateTime> startDates; // of the first-leg runs, unset for second legs
+
+  // First legs: from each train through from to any later station, on the run
+  // that leaves from on date.
+  vector<TransferLeg> firstLegs;
+  vector<DateTime> departures, arrivals; // of each first leg
+  size_t hashedFrom = stringHasher(from.c_str());
+  for (auto it = transferLookupDB.lower_bound(hashedFrom);
+       it.valid() && it.key() == hashedFrom; it.next()) {
+    const TrainCatalog::Entry *entry = getTrain(it.value(), true);
+    if (entry == nullptr || !entry->train.isReleased) {
+      continue;
+    }
+    const Train &train = entry->train;
+    StationRun stations = catalog.stations(entry);
+    int fromIdx = stations.find(hashedFrom, from);
+    if (fromIdx == -1) {
+      continue;
+    }
 
-  auto firstLegTrainIDs = transferLookupDB.find(stringHasher(from.c_str()));
+    int leavingOffset = stations.leavings[fromIdx];
+    DateTime startDate = date;
+    startDate.minusDuration((leavingOffset + train.startTime.getTimeMinutes()) /
+                            1440 * 1440); // Adjust to train's start time
+    if (startDate.getDateMMDD() < train.saleStartDate.getDateMMDD() ||
+        startDate.getDateMMDD() > train.saleEndDate.getDateMMDD()) {
+      continue; // Not on sale on this date
+    }
+    DateTime start(startDate.getDateMMDD(), train.startTime.getTimeMinutes());
+    DateTime departure = start;
+    departure.addDuration(leavingOffset);
+
+    for (int k = fromIdx + 1; k < train.stationNum; ++k) {
+      DateTime arrival = start;
+      arrival.addDuration(stations.arrivals[k]);
+      firstLegs.push_back(TransferLeg{
+          stations.hashes[k], int(trains.size()),
+          TicketPosting{it.value(), fromIdx, k, stations.price(fromIdx, k),
+                        leavingOffset, stations.arrivals[k]}});
+      departures.push_back(departure);
+      arrivals.push_back(arrival);
+    }
+    trains.push_back(train);
+    startDates.push_back(startDate);
+  }
+  if (firstLegs.empty()) {
+    countLookups();
+    LOG("No transfer route found");
+    return "";
+  }
 
-  for (const auto &train1ID : firstLegTrainIDs) {
-    auto foundTrain1Vec = trainDB.find(train1ID);
-    if (foundTrain1Vec.empty() || !foundTrain1Vec[0].isReleased) {
+  // Second legs: from any station of each train through to, before to.
+  TransferLegIndex secondLegs;
+  size_t hashedTo = stringHasher(to.c_str());
+  for (auto it = transferLookupDB.lower_bound(hashedTo);
+       it.valid() && it.key() == hashedTo; it.next()) {
+    const TrainCatalog::Entry *entry = getTrain(it.value(), true);
+    if (entry == nullptr || !entry->train.isReleased) {
       continue;
     }
-    Train train1_obj = foundTrain1Vec[0];
-    vector<Station> stations_train1 = stationBucketManager.queryStations(
-        train1_obj.stationBucketID, train1_obj.stationNum);
-
-    int from_idx_train1 = -1;
-    for (int i = 0; i < train1_obj.stationNum; ++i) {
-      if (stations_train1[i].name == from) {
-        from_idx_train1 = i;
-        break;
-      }
+    StationRun stations = catalog.stations(entry);
+    int toIdx = stations.find(hashedTo, to);
+    if (toIdx <= 0) {
+      continue;
     }
 
-    if (from_idx_train1 == -1) {
+    for (int k = toIdx - 1; k >= 0; --k) {
+      secondLegs.add(TransferLeg{
+          stations.hashes[k], int(trains.size()),
+          TicketPosting{it.value(), k, toIdx, stations.price(k, toIdx),
+                        stations.leavings[k], stations.arrivals[toIdx]}});
+    }
+    trains.push_back(entry->train);
+    startDates.push_back(DateTime());
+  }
+  secondLegs.build();
+
+  // Join on the transfer station. The best pair is ordered by sortBy, then
+  // the other measure, then the two train IDs, then the first leg's place in
+  // firstLegs, which is the order the exhaustive search used to meet them in.
+  //
+  // Neither measure can fall below what the rides alone add up to: waiting
+  // at the transfer only adds time. First legs are tried by that bound on
+  // sortBy's measure, so once one cannot beat the best pair none after it can.
+  vector<std::pair<int, int>> order; // bound, index into firstLegs
+  for (size_t a = 0; a < firstLegs.size(); ++a) {
+    const TransferLegIndex::Group *group =
+        secondLegs.find(firstLegs[a].station);
+    if (group == nullptr) {
       continue;
     }
-
-    for (int transfer_station_idx_train1 = from_idx_train1 + 1;
-         transfer_station_idx_train1 < train1_obj.stationNum;
-         ++transfer_station_idx_train1) {
-
-      const Station &transferStation =
-          stations_train1[transfer_station_idx_train1];
-
-      int price_train1_leg = 0;
-      for (int k = from_idx_train1 + 1; k <= transfer_station_idx_train1; ++k) {
-        price_train1_leg += stations_train1[k].price;
-      }
-
-      DateTime queryDate(date_s32); // Parse "mm-dd" string
-      queryDate.minusDuration(
-          (stations_train1[from_idx_train1].leavingTimeOffset +
-           train1_obj.startTime.getTimeMinutes()) /
-          1440 * 1440); // Adjust to train's start time
-      if (queryDate.getDateMMDD() < train1_obj.saleStartDate.getDateMMDD() ||
-          queryDate.getDateMMDD() > train1_obj.saleEndDate.getDateMMDD()) {
-        continue; // Not on sale on this date
+    const TicketPosting &posting = firstLegs[a].posting;
+    int bound = byCost ? posting.price + group->minPrice
+                       : posting.arrivalOffset - posting.leavingOffset +
+                             group->minRide;
+    order.push_back(std::make_pair(bound, int(a)));
+    lastTransfer.pairs += group->count;
+  }
+  std::sort(order.begin(), order.end());
+
+  int best1 = -1, best2 = -1;
+  int bestPrice = 0, bestDuration = 0;
+  DateTime bestStart2;
+  auto bestKey = [&]() { return byCost ? bestPrice : bestDuration; };
+  for (size_t i = 0; i < order.size(); ++i) {
+    int a = order[i].second;
+    const TransferLeg &leg1 = firstLegs[a];
+    const TransferLegIndex::Group *group = secondLegs.find(leg1.station);
+    if (best1 != -1 && order[i].first > bestKey()) {
+      for (; i < order.size(); ++i) {
+        const TransferLeg &rest = firstLegs[order[i].second];
+        lastTransfer.pruned += secondLegs.find(rest.station)->count;
       }
+      break;
+    }
 
-      // Now queryDate is the actual departure date of train1
-
-      DateTime departureDateTime_train1_leg(
-          queryDate.getDateMMDD(), train1_obj.startTime.getTimeMinutes());
-      departureDateTime_train1_leg.addDuration(
-          stations_train1[from_idx_train1].leavingTimeOffset);
-
-      DateTime arrivalAtTransferDateTime_train1_leg(
-          queryDate.getDateMMDD(), train1_obj.startTime.getTimeMinutes());
-      arrivalAtTransferDateTime_train1_leg.addDuration(
-          stations_train1[transfer_station_idx_train1].arrivalTimeOffset);
-
-      int duration_train1_leg =
-          stations_train1[transfer_station_idx_train1].arrivalTimeOffset -
-          stations_train1[from_idx_train1].leavingTimeOffset;
-
-      vector<int> leftSeats_train1_vec = queryLeftSeats(
-          train1ID, queryDate, from_idx_train1, transfer_station_idx_train1);
-      int seatsAvailable_train1_leg = std::numeric_limits<int>::max();
-
-      for (int seat : leftSeats_train1_vec) {
-        seatsAvailable_train1_leg = std::min(seatsAvailable_train1_leg, seat);
+    const Train &train1 = trains[leg1.train];
+    int ride1 = leg1.posting.arrivalOffset - leg1.posting.leavingOffset;
+    for (int b = group->first; b != -1; b = secondLegs.next(b)) {
+      const TransferLeg &leg2 = secondLegs.leg(b);
+      const Train &train2 = trains[leg2.train];
+      if (train2.trainID == train1.trainID) {
+        continue;
       }
-
-      TicketCandidate ticket1(
-          train1_obj.trainID, price_train1_leg, duration_train1_leg,
-          stations_train1[from_idx_train1].name, transferStation.name,
-          departureDateTime_train1_leg, arrivalAtTransferDateTime_train1_leg,
-          seatsAvailable_train1_leg);
-
-      vector<TicketCandidate> secondLegCandidates =
-          querySingle(transferStation.name, to,
-                      arrivalAtTransferDateTime_train1_leg, sortBy, true);
-
-      for (const auto &ticket2 : secondLegCandidates) {
-        if (ticket2.trainID == train1_obj.trainID) {
+      if (best1 != -1) {
+        int bound = byCost ? leg1.posting.price + leg2.posting.price
+                           : ride1 + leg2.posting.arrivalOffset -
+                                 leg2.posting.leavingOffset;
+        if (bound > bestKey()) {
+          lastTransfer.pruned++;
           continue;
         }
-
-        if (!(ticket2.departureDateTime >=
-              arrivalAtTransferDateTime_train1_leg)) {
-          LOG("Skipping second leg: " + ticket2.trainID.toString() +
-              " due to invalid departure time after first leg");
-          continue;
+      }
+      lastTransfer.evaluated++;
+      DateTime start2;
+      if (!transferStartDate(train2, leg2.posting.leavingOffset, arrivals[a],
+                             start2)) {
+        continue;
+      }
+      DateTime end2(start2.getDateMMDD(), train2.startTime.getTimeMinutes());
+      end2.addDuration(leg2.posting.arrivalOffset);
+      int price = leg1.posting.price + leg2.posting.price;
+      int duration = departures[a].calcDuration(end2);
+
+      if (best1 != -1) {
+        int key = byCost ? price : duration;
+        int other = byCost ? duration : price;
+        int bestOther = byCost ? bestDuration : bestPrice;
+        const Train &bestTrain1 = trains[firstLegs[best1].train];
+        const Train &bestTrain2 = trains[secondLegs.leg(best2).train];
+        bool better;
+        if (key != bestKey()) {
+          better = key < bestKey();
+        } else if (other != bestOther) {
+          better = other < bestOther;
+        } else if (!(train1.trainID == bestTrain1.trainID)) {
+          better = train1.trainID < bestTrain1.trainID;
+        } else if (!(train2.trainID == bestTrain2.trainID)) {
+          better = train2.trainID < bestTrain2.trainID;
+        } else {
+          better = a < best1;
         }
-
-        int currentTotalPrice = ticket1.price + ticket2.price;
-        int currentTotalDuration =
-            ticket1.departureDateTime.calcDuration(ticket2.endDateTime);
-
-        LOG("Evaluating transfer: " + ticket1.trainID.toString() + " -> " +
-            ticket2.trainID.toString() + " with total price " +
-            std::to_string(currentTotalPrice) + " and total duration " +
-            std::to_string(currentTotalDuration) +
-            "; Max Price: " + std::to_string(bestTotalPrice) +
-            ", Max Duration: " + std::to_string(bestTotalDuration));
-
-        if (sortBy == "cost") {
-          // Cost as primary, time as secondary, train1 ID as tertiary, train2
-          // ID as quaternary
-          if (!transferFound || currentTotalPrice < bestTotalPrice ||
-              (currentTotalPrice == bestTotalPrice &&
-               currentTotalDuration < bestTotalDuration) ||
-              (currentTotalPrice == bestTotalPrice &&
-               currentTotalDuration == bestTotalDuration &&
-               ticket1.trainID < bestPrice_train1ID_tie) ||
-              (currentTotalPrice == bestTotalPrice &&
-               currentTotalDuration == bestTotalDuration &&
-               ticket1.trainID == bestPrice_train1ID_tie &&
-               ticket2.trainID < bestPrice_train2ID_tie)) {
-            bestTotalPrice = currentTotalPrice;
-            bestTotalDuration = currentTotalDuration;
-            bestPrice_train1ID_tie = ticket1.trainID;
-            bestPrice_train2ID_tie = ticket2.trainID;
-            bestLeg1Candidate = ticket1;
-            bestLeg2Candidate = ticket2;
-            transferFound = true;
-          }
-        } else if (sortBy == "time") {
-          // Time as primary, cost as secondary, train1 ID as tertiary, train2
-          // ID as quaternary
-          if (!transferFound || currentTotalDuration < bestTotalDuration ||
-              (currentTotalDuration == bestTotalDuration &&
-               currentTotalPrice < bestTotalPrice) ||
-              (currentTotalDuration == bestTotalDuration &&
-               currentTotalPrice == bestTotalPrice &&
-               ticket1.trainID < bestTime_train1ID_tie) ||
-              (currentTotalDuration == bestTotalDuration &&
-               currentTotalPrice == bestTotalPrice &&
-               ticket1.trainID == bestTime_train1ID_tie &&
-               ticket2.trainID < bestTime_train2ID_tie)) {
-            bestTotalDuration = currentTotalDuration;
-            bestTotalPrice = currentTotalPrice;
-            bestTime_train1ID_tie = ticket1.trainID;
-            bestTime_train2ID_tie = ticket2.trainID;
-            bestLeg1Candidate = ticket1;
-            bestLeg2Candidate = ticket2;
-            transferFound = true;
-          }
+        if (!better) {
+          continue;
         }
       }
+      best1 = a;
+      best2 = b;
+      bestPrice = price;
+      bestDuration = duration;
+      bestStart2 = start2;
     }
   }
+  LOG("Transfer join: " + std::to_string(lastTransfer.pairs) + " pairs, " +
+      std::to_string(lastTransfer.evaluated) + " evaluated, " +
+      std::to_string(lastTransfer.pruned) + " pruned");
 
-  if (!transferFound) {
+  if (best1 == -1) {
+    countLookups();
     LOG("No transfer route found");
     return "";
   }
 
+  // Seats do not take part in the choice, so only the winner reads them.
+  const TransferLeg &leg1 = firstLegs[best1];
+  const TransferLeg &leg2 = secondLegs.leg(best2);
+  const Train &train1 = trains[leg1.train];
+  const Train &train2 = trains[leg2.train];
+  int seats1 = queryLeftSeats(train1, startDates[leg1.train],
+                              leg1.posting.fromIdx, leg1.posting.toIdx);
+  int seats2 = queryLeftSeats(train2, bestStart2, leg2.posting.fromIdx,
+                              leg2.posting.toIdx);
+  const TrainCatalog::Entry *entry1 =
+      getTrain(leg1.posting.hashedTrainID, true);
+  string32 transfer = catalog.stations(entry1).names[leg1.posting.toIdx];
+  countLookups();
+  LOG("Transfer lookups: " + std::to_string(lastTransfer.lookups.trainHits) +
+      "/" + std::to_string(lastTransfer.lookups.trains) + " trains and " +
+      std::to_string(lastTransfer.lookups.seatRowHits) + "/" +
+      std::to_string(lastTransfer.lookups.seatRows) +
+      " seat rows from memory");
+
+  DateTime departure2(bestStart2.getDateMMDD(),
+                      train2.startTime.getTimeMinutes());
+  departure2.addDuration(leg2.posting.leavingOffset);
+  DateTime end2(bestStart2.getDateMMDD(), train2.startTime.getTimeMinutes());
+  end2.addDuration(leg2.posting.arrivalOffset);
+
+  TicketCandidate ticket1(
+      train1.trainID, leg1.posting.price,
+      leg1.posting.arrivalOffset - leg1.posting.leavingOffset, from, transfer,
+      departures[best1], arrivals[best1], seats1);
+  TicketCandidate ticket2(
+      train2.trainID, leg2.posting.price,
+      leg2.posting.arrivalOffset - leg2.posting.leavingOffset, transfer, to,
+      departure2, end2, seats2);
+
   std::ostringstream oss;
-  oss << bestLeg1Candidate << "\n" << bestLeg2Candidate;
-  LOG("Found transfer route with " + std::to_string(transferFound ? 2 : 0) +
-      " legs");
+  oss << ticket1 << "\n" << ticket2;
+  LOG("Found transfer route: " + train1.trainID.toString() + " -> " +
+      train2.trainID.toString());
   return oss.str();
 }
 
@@ -920,12 +1761,13 @@ TrainManager::buyTicket(const string32 &trainID, const DateTime &departureDate,
       trainID.toString() + " from " + from_station_name.toString() + " to " +
       to_station_name.toString());
 
-  auto foundTrains = trainDB.find(stringHasher(trainID.c_str()));
-  if (foundTrains.empty() || !foundTrains[0].isReleased) {
+  const TrainCatalog::Entry *entry =
+      getTrain(stringHasher(trainID.c_str()), true);
+  if (entry == nullptr || !entry->train.isReleased) {
     ERROR("Train not found or not released: " + trainID.toString());
     return {-1, -1, false, -1, -1, -1, -1};
   }
-  Train train = foundTrains[0];
+  const Train &train = entry->train;
 
   if (num > train.seatNum) {
     ERROR("Not enough seats available: requested " + std::to_string(num) +
@@ -933,30 +1775,22 @@ TrainManager::buyTicket(const string32 &trainID, const DateTime &departureDate,
     return {-1, -1, false, -1, -1, -1, -1}; // Not enough seats available
   }
 
-  int from_idx = -1;
-  int to_idx = -1;
-
-  vector<Station> stations = stationBucketManager.queryStations(
-      train.stationBucketID, train.stationNum);
-  for (int i = 0; i < train.stationNum; ++i) {
-    if (train.stationBucketID == -1) {
-      ERROR("No stations available for train: " + trainID.toString());
-      return {-1, -1, false, -1, -1, -1, -1}; // No stations available
-    }
-    if (stations[i].name == from_station_name) {
-      from_idx = i;
-    }
-    if (stations[i].name == to_station_name) {
-      to_idx = i;
-    }
+  if (train.stationBucketID == -1) {
+    ERROR("No stations available for train: " + trainID.toString());
+    return {-1, -1, false, -1, -1, -1, -1}; // No stations available
   }
+  StationRun stations = catalog.stations(entry);
+  int from_idx = stations.find(stringHasher(from_station_name.c_str()),
+                               from_station_name);
+  int to_idx =
+      stations.find(stringHasher(to_station_name.c_str()), to_station_name);
   if (from_idx == -1 || to_idx == -1 || from_idx >= to_idx) {
     ERROR("Invalid station names or indices for train: " + trainID.toString());
     return {-1, -1, false, -1, -1, -1, -1}; // Invalid station names or indices
   }
 
   DateTime queryDate = departureDate;
-  queryDate.minusDuration((stations[from_idx].leavingTimeOffset +
+  queryDate.minusDuration((stations.leavings[from_idx] +
                            train.startTime.getTimeMinutes()) /
                           1440 * 1440); // Adjust to train's start time
   if (queryDate.getDateMMDD() < train.saleStartDate.getDateMMDD() ||
@@ -965,13 +1799,10 @@ TrainManager::buyTicket(const string32 &trainID, const DateTime &departureDate,
     return {-1, -1, false, -1, -1, -1, -1}; // Not on sale on this date
   }
 
-  bool flag = updateLeftSeats(trainID, queryDate, from_idx, to_idx, -num);
-
-  int totalPrice = 0;
-  for (int i = from_idx + 1; i <= to_idx; ++i) {
-    totalPrice += stations[i].price;
-  }
+  bool flag = updateLeftSeats(stringHasher(trainID.c_str()), queryDate,
+                              from_idx, to_idx, -num);
 
+  int totalPrice = stations.price(from_idx, to_idx);
   totalPrice *= num; // Total price for the number of tickets
 
   if (flag) {
@@ -987,23 +1818,114 @@ TrainManager::buyTicket(const string32 &trainID, const DateTime &departureDate,
       flag,
       from_idx,
       to_idx,
-      train.startTime.getTimeMinutes() + stations[from_idx].leavingTimeOffset,
-      train.startTime.getTimeMinutes() + stations[to_idx].arrivalTimeOffset};
+      train.startTime.getTimeMinutes() + stations.leavings[from_idx],
+      train.startTime.getTimeMinutes() + stations.arrivals[to_idx]};
+}
+
+const TrainCatalog::Entry *TrainManager::getTrain(size_t hashedID,
+                                                  bool withStations) {
+  const TrainCatalog::Entry *entry = catalog.find(hashedID);
+  trainLookups++;
+  if (entry != nullptr && (!withStations || entry->firstStation != -1)) {
+    trainHits++;
+  }
+  if (entry == nullptr && bulkTrains.count(hashedID) > 0) {
+    entry = catalog.insert(hashedID, bulkTrains[hashedID]);
+  } else if (entry == nullptr) {
+    auto foundTrains = trainDB.find(hashedID);
+    if (foundTrains.empty()) {
+      return nullptr;
+    }
+    entry = catalog.insert(hashedID, foundTrains[0]);
+  }
+  if (withStations && entry->firstStation == -1) {
+    entry = catalog.attachStations(
+        entry, stationBucketManager.queryStations(entry->train.stationBucketID,
+                                                  entry->train.stationNum));
+  }
+  return entry;
+}
+
+void TrainManager::applyBulkLoad() {
+  if (!bulkTrains.empty()) {
+    vector<std::pair<size_t, Train>> trains;
+    for (auto it = bulkTrains.cbegin(); it != bulkTrains.cend(); ++it) {
+      trains.push_back(*it);
+    }
+    trainDB.insert_sorted(trains.data(), trains.size());
+    bulkTrains.clear();
+  }
+  std::sort(bulkPostings.begin(), bulkPostings.end());
+  ticketLookupDB.insert_sorted(bulkPostings.data(), bulkPostings.size());
+  bulkPostings.clear();
+  std::sort(bulkStops.begin(), bulkStops.end());
+  stationStopDB.insert_sorted(bulkStops.data(), bulkStops.size());
+  bulkStops.clear();
+  std::sort(bulkTransfers.begin(), bulkTransfers.end());
+  transferLookupDB.insert_sorted(bulkTransfers.data(), bulkTransfers.size());
+  bulkTransfers.clear();
 }
 
-bool TrainManager::refundTicket(const string32 &trainID,
+void TrainManager::flush(bool durable) {
+  if (durable) {
+    trainDB.sync();
+    ticketLookupDB.sync();
+    stationStopDB.sync();
+    transferLookupDB.sync();
+    stationBucketManager.sync();
+    ticketBucketManager.sync();
+  } else {
+    trainDB.flush();
+    ticketLookupDB.flush();
+    stationStopDB.flush();
+    transferLookupDB.flush();
+    ticketBucketManager.flush();
+  }
+}
+
+void TrainManager::compact() {
+  endBulkLoad();
+  // Copy the station runs of the trains left densely, dropping those of
+  // deleted trains, and point every train at its new run.
+  vector<std::pair<size_t, Train>> trains;
+  vector<std::pair<int, int>> runs;
+  for (auto it = trainDB.begin(); it.valid(); it.next()) {
+    const Train &train = it.value();
+    trains.push_back({it.key(), train});
+    if (train.stationBucketID != -1) {
+      runs.push_back({train.stationBucketID, train.stationNum});
+    }
+  }
+  vector<int> moved = stationBucketManager.compact(runs);
+  for (size_t i = 0, j = 0; i < trains.size(); ++i) {
+    if (trains[i].second.stationBucketID != -1) {
+      trains[i].second.stationBucketID = moved[j++];
+    }
+  }
+  trainDB.clear();
+  trainDB.insert_sorted(trains.data(), trains.size());
+  catalog.clear();
+
+  trainDB.compact();
+  ticketLookupDB.compact();
+  stationStopDB.compact();
+  transferLookupDB.compact();
+}
+
+bool TrainManager::refundTicket(const size_t hashedTrainID,
                                 const DateTime &departureDate, int num,
                                 const int from_idx, const int to_idx) {
   LOG("Refunding " + std::to_string(num) + " tickets for train " +
-      trainID.toString());
+      std::to_string(hashedTrainID));
 
-  auto foundTrains = trainDB.find(stringHasher(trainID.c_str()));
-  if (foundTrains.empty() || !foundTrains[0].isReleased) {
-    ERROR("Train not found or not released for refund: " + trainID.toString());
+  const TrainCatalog::Entry *entry = getTrain(hashedTrainID);
+  if (entry == nullptr || !entry->train.isReleased) {
+    ERROR("Train not found or not released for refund: " +
+          std::to_string(hashedTrainID));
     return false;
   }
-  Train train = foundTrains[0];
-  bool result = updateLeftSeats(trainID, departureDate, from_idx, to_idx, num);
+  bool result =
+      updateLeftSeats(hashedTrainID, departureDate, from_idx, to_idx, num);
 
   if (result) {
     LOG("Successfully refunded " + std::to_string(num) + " tickets");
@@ -1014,59 +1936,80 @@ bool TrainManager::refundTicket(const string32 &trainID,
   return result;
 }
 
-vector<int> TrainManager::queryLeftSeats(const size_t hashedTrainID,
-                                         DateTime date,
-                                         const int from_station_idx,
-                                         const int to_station_idx) {
-  auto foundTrains = trainDB.find(hashedTrainID);
-  if (foundTrains.empty()) {
+int TrainManager::queryLeftSeats(const size_t hashedTrainID, DateTime date,
+                                 const int from_station_idx,
+                                 const int to_station_idx) {
+  const TrainCatalog::Entry *entry = getTrain(hashedTrainID);
+  if (entry == nullptr) {
     ERROR("Train not found for seat query: " + std::to_string(hashedTrainID));
-    return vector<int>(); // No such train
+    return std::numeric_limits<int>::max(); // No such train
   }
-  Train train = foundTrains[0];
+  return queryLeftSeats(entry->train, date, from_station_idx, to_station_idx);
+}
+
+int TrainManager::queryLeftSeats(const Train &train, DateTime date,
+                                 const int from_station_idx,
+                                 const int to_station_idx) {
   if (!train.isReleased) {
-    vector<int> seats(to_station_idx - from_station_idx, train.seatNum);
-    LOG("Querying seats for unreleased train: " +
-        std::to_string(hashedTrainID));
-    return seats;
+    LOG("Querying seats for unreleased train: " + train.trainID.toString());
+    return train.seatNum;
   }
 
   int dayIndex =
       calcDateDuration(train.saleStartDate.getDateMMDD(), date.getDateMMDD());
   if (dayIndex < 0) {
-    ERROR("Date is before sale starts for train: " +
-          std::to_string(hashedTrainID));
-    return vector<int>(); // Date is before sale starts
+    ERROR("Date is before sale starts for train: " + train.trainID.toString());
+    return std::numeric_limits<int>::max(); // Date is before sale starts
   }
-
-  int baseOffsetForDay = dayIndex * (train.stationNum - 1);
-  int startOffsetInBucket = baseOffsetForDay + from_station_idx;
-
-  int numElementsToQuery = to_station_idx - from_station_idx;
-  if (numElementsToQuery <= 0) {
+  if (to_station_idx - from_station_idx <= 0) {
     ERROR("Invalid station indices for seat query");
-    return vector<int>();
+    return std::numeric_limits<int>::max();
   }
 
-  LOG("Querying left seats for train " + std::to_string(hashedTrainID) +
+  LOG("Querying left seats for train " + train.trainID.toString() +
       " from station " + std::to_string(from_station_idx) + " to " +
       std::to_string(to_station_idx));
 
-  return ticketBucketManager.queryTickets(
-      train.ticketBucketID, startOffsetInBucket, numElementsToQuery);
+  return ticketBucketManager.minTickets(train.ticketBucketID, dayIndex,
+                                        train.stationNum - 1, from_station_idx,
+                                        to_station_idx);
 }
 
-bool TrainManager::updateLeftSeats(const string32 &trainID, DateTime date,
+vector<int> TrainManager::queryLeftSeats(const size_t hashedTrainID,
+                                         DateTime date) {
+  const TrainCatalog::Entry *entry = getTrain(hashedTrainID);
+  if (entry == nullptr) {
+    ERROR("Train not found for seat query: " + std::to_string(hashedTrainID));
+    return vector<int>(); // No such train
+  }
+  const Train &train = entry->train;
+  if (!train.isReleased) {
+    return vector<int>(train.stationNum - 1, train.seatNum);
+  }
+
+  int dayIndex =
+      calcDateDuration(train.saleStartDate.getDateMMDD(), date.getDateMMDD());
+  if (dayIndex < 0) {
+    ERROR("Date is before sale starts for train: " +
+          std::to_string(hashedTrainID));
+    return vector<int>(); // Date is before sale starts
+  }
+  return ticketBucketManager.queryTickets(train.ticketBucketID, dayIndex,
+                                          train.stationNum - 1);
+}
+
+bool TrainManager::updateLeftSeats(const size_t hashedTrainID, DateTime date,
                                    const int from_station_idx,
                                    const int to_station_idx, int num) {
-  auto foundTrains = trainDB.find(stringHasher(trainID.c_str()));
-  if (foundTrains.empty()) {
-    ERROR("Train not found for seat update: " + trainID.toString());
+  const TrainCatalog::Entry *entry = getTrain(hashedTrainID);
+  if (entry == nullptr) {
+    ERROR("Train not found for seat update: " + std::to_string(hashedTrainID));
     return false; // No such train
   }
-  Train train = foundTrains[0];
+  const Train &train = entry->train;
   if (!train.isReleased) {
-    ERROR("Cannot update seats for unreleased train: " + trainID.toString());
+    ERROR("Cannot update seats for unreleased train: " +
+          train.trainID.toString());
     return false;
   }
 
@@ -1076,35 +2019,40 @@ bool TrainManager::updateLeftSeats(const string32 &trainID, DateTime date,
     ERROR("Date is before sale starts for seat update");
     return false; // Date is before sale starts
   }
-
-  int baseOffsetForDay = dayIndex * (train.stationNum - 1);
-  int startOffsetInBucket = baseOffsetForDay + from_station_idx;
-
-  int numElementsToQuery = to_station_idx - from_station_idx;
-  if (numElementsToQuery <= 0) {
+  if (to_station_idx - from_station_idx <= 0) {
     ERROR("Invalid station indices for seat update");
     return false;
   }
 
-  auto tickets = ticketBucketManager.queryTickets(
-      train.ticketBucketID, startOffsetInBucket, numElementsToQuery);
-
-  for (int &ticket : tickets) {
-    ticket += num; // Update the number of available seats
-    LOG("Current available seats: " + std::to_string(ticket) +
-        "; Previous: " + std::to_string(ticket - num));
-    if (ticket < 0) {
-      ERROR("Cannot have negative seats");
-      return false; // Cannot have negative seats
-    }
+  if (!ticketBucketManager.addTickets(train.ticketBucketID, dayIndex,
+                                      train.stationNum - 1, from_station_idx,
+                                      to_station_idx, num)) {
+    ERROR("Cannot have negative seats");
+    return false; // Cannot have negative seats
   }
 
-  ticketBucketManager.updateTickets(train.ticketBucketID, startOffsetInBucket,
-                                    numElementsToQuery, tickets);
-
-  LOG("Updated seats for train " + trainID.toString() + " by " +
+  LOG("Updated seats for train " + train.trainID.toString() + " by " +
       std::to_string(num));
   return true;
 }
 
-#endif // TRAIN_MANAGER_HPP
\ No newline at end of file
+vector<int> TrainManager::takeSeats(const size_t hashedTrainID, DateTime date,
+                                    const vector<SeatRequest> &requests) {
+  const TrainCatalog::Entry *entry = getTrain(hashedTrainID);
+  if (entry == nullptr || !entry->train.isReleased) {
+    ERROR("Train not found or not released for seat update: " +
+          std::to_string(hashedTrainID));
+    return vector<int>();
+  }
+  const Train &train = entry->train;
+  int dayIndex =
+      calcDateDuration(train.saleStartDate.getDateMMDD(), date.getDateMMDD());
+  if (dayIndex < 0) {
+    ERROR("Date is before sale starts for seat update");
+    return vector<int>();
+  }
+  return ticketBucketManager.takeTickets(train.ticketBucketID, dayIndex,
+                                         train.stationNum - 1, requests);
+}
+
+#endif // TRAIN_MANAGER_HPP
@@ -68,6 +68,16 @@ public:
   void clean();
   void clearLoggedInUsers();
 
+  /**
+   * @brief Write dirty pages back; with durable set, also fsync every file.
+   */
+  void flush(bool durable = false);
+
+  /**
+   * @brief Rewrite the user tree without its freed pages.
+   */
+  void compact();
+
   bool isLoggedIn(const string32 &username) const;
 
 private:
@@ -172,6 +182,16 @@ void UserManager::clean() {
 
 void UserManager::clearLoggedInUsers() { loggedInUsers.clear(); }
 
+void UserManager::flush(bool durable) {
+  if (durable) {
+    userDB.sync();
+  } else {
+    userDB.flush();
+  }
+}
+
+void UserManager::compact() { userDB.compact(); }
+
 bool UserManager::isLoggedIn(const string32 &username) const {
   return loggedInUsers.find(username) != loggedInUsers.cend();
 }
@@ -1,12 +1,12 @@
 #ifndef BPT_NODE_HPP
 #define BPT_NODE_HPP
 
+#include "nodeSearch.hpp"
 #include <string>
 
 template <typename Key, size_t NODE_SIZE = 4> struct BPTNode {
 public:
   int node_id; // BPT node id = index in file
-  int parent_id;
 
   bool is_leaf;
   bool is_root;
@@ -18,6 +18,13 @@ public:
   int children[NODE_SIZE + 1]; // internal page: children, leaf page: block id
 
   BPTNode() : is_leaf(false), is_root(false), key_count(0) {}
+
+  /**
+   * @brief Index of the first of keys[0, n) that is not less than key.
+   */
+  int lower_bound(const Key &key, int n) const {
+    return NodeSearch<Key>::lower_bound(keys, n, key);
+  }
 };
 
 template <typename Key, typename Value, size_t BLOCK_SIZE = 4>
@@ -28,9 +35,8 @@ public:
   int key_count;
   int block_id;
   int next_block_id;
-  int parent_id;
 
-  DataBlock() : key_count(0), block_id(-1), next_block_id(-1), parent_id(-1) {}
+  DataBlock() : key_count(0), block_id(-1), next_block_id(-1) {}
 
   /**
    * @brief delete a key from the block.
@@ -136,7 +142,6 @@ public:
     }
 
     new_block.next_block_id = next_block_id;
-    new_block.parent_id = parent_id;
     key_count = mid;
 
     return {true, new_block};
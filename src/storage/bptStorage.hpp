@@ -2,19 +2,45 @@
 #define BPT_STORAGE_HPP
 
 #include "bptNode.hpp"
-#include "cachedFileOperation.hpp"
+#include "stl/map.hpp"
 #include "stl/vector.hpp"
-#include "storage/cache/fileOperation.hpp"
-#include <functional>
+#include "storageBackend.hpp"
+#include <cassert>
 
+// Default number of tree levels kept pinned and their memory budget.
+constexpr size_t BPT_PINNED_LEVELS = 3;
+constexpr size_t BPT_PINNED_BYTES = BUFFER_POOL_BYTES / 2;
+
+// insert_sorted() rebuilds the tree when the batch fills a block and is at
+// least this fraction of the entries already in it, and inserts one by one
+// otherwise.
+constexpr size_t BPT_BULK_REBUILD_RATIO = 16;
+
+/**
+ * @tparam PageManager record file the tree pages live in. It must provide the
+ * FileOperation interface plus pin()/unpin()/capacity()/replace_with() and
+ * flush()/sync(); the default is a bounded LRU-K buffer pool, so hot internal
+ * nodes are served from memory, or the mapped file itself when built with
+ * TICKET_SYSTEM_MMAP.
+ * @note The root and the upper levels of the tree stay pinned in the pool, so
+ * a lookup only reaches disk for the leaf and its data blocks. Pinned pages are
+ * updated in place and written back on flush().
+ */
 template <typename Key, typename Value, size_t NODE_SIZE = 40,
-          size_t BLOCK_SIZE = 40>
+          size_t BLOCK_SIZE = 40,
+          template <class, int> class PageManager = DefaultPageManager>
 class BPTStorage {
 public:
   using NodeType = BPTNode<Key, NODE_SIZE>;
   using BlockType = DataBlock<Key, Value, BLOCK_SIZE>;
 
-  BPTStorage(const std::string &file_prefix, const Key &MAX_KEY);
+  /**
+   * @param pinned_levels number of levels, from the root down, to keep pinned.
+   * @param pinned_bytes memory budget for pinned nodes, filled level by level.
+   */
+  BPTStorage(const std::string &file_prefix, const Key &MAX_KEY,
+             size_t pinned_levels = BPT_PINNED_LEVELS,
+             size_t pinned_bytes = BPT_PINNED_BYTES);
   ~BPTStorage();
 
   /**
@@ -29,35 +55,211 @@ public:
 
   /**
    * @brief Find a key in the B+ tree.
-   * @return vector of values associated with the key, or nullptr if not found.
+   * @return values associated with the key in storage order, which is
+   * ascending: blocks keep their pairs sorted and insert() keeps the block
+   * chain sorted across equal keys.
    */
   sjtu::vector<Value> find(Key key);
 
+  /**
+   * @brief Insert n entries sorted by key, then value.
+   * @note A batch of at least a block, unless the tree holds more than
+   * BPT_BULK_REBUILD_RATIO times as many entries, rebuilds it bottom-up: its
+   * entries and the new ones are merged into fresh files in one sequential
+   * pass, with full blocks and nodes.
+   */
+  void insert_sorted(const std::pair<Key, Value> *entries, size_t n);
+
+  /**
+   * @brief Number of entries in the tree.
+   */
+  size_t size() const { return entry_count; }
+
+  /**
+   * @brief Forward cursor over the entries in key order.
+   * @note It keeps the data block it stands on pinned while following
+   * next_block_id, so it survives reads of the tree but not insert() or
+   * remove().
+   */
+  class Cursor {
+  public:
+    Cursor(Cursor &&other)
+        : tree(other.tree), block_id(other.block_id), block(other.block),
+          pos(other.pos) {
+      other.block_id = -1;
+      other.block = nullptr;
+    }
+    Cursor(const Cursor &) = delete;
+    Cursor &operator=(const Cursor &) = delete;
+
+    ~Cursor() { release(); }
+
+    bool valid() const { return block != nullptr && pos < block->key_count; }
+    const Key &key() const { return block->data[pos].first; }
+    const Value &value() const { return block->data[pos].second; }
+
+    void next() {
+      pos++;
+      settle();
+    }
+
+  private:
+    friend class BPTStorage;
+
+    BPTStorage *tree;
+    int block_id = -1;
+    const BlockType *block = nullptr;
+    int pos = 0;
+
+    explicit Cursor(BPTStorage *tree) : tree(tree) {}
+
+    void release() {
+      if (block_id != -1) {
+        tree->data_file.unpin(block_id, false);
+      }
+      block_id = -1;
+      block = nullptr;
+    }
+
+    void load(int id) {
+      release();
+      block_id = id;
+      block = tree->data_file.pin(id);
+      pos = 0;
+    }
+
+    // Step over exhausted and empty blocks.
+    void settle() {
+      while (block != nullptr && pos >= block->key_count &&
+             block->next_block_id != -1) {
+        load(block->next_block_id);
+      }
+    }
+  };
+
+  /**
+   * @brief Cursor at the first entry whose key is not less than key.
+   */
+  Cursor lower_bound(const Key &key);
+
+  /**
+   * @brief Cursor at the first entry.
+   */
+  Cursor begin();
+
+  /**
+   * @brief Call fn(key, value) for every entry with lo <= key <= hi, in order.
+   * @note fn returns false to stop the scan early.
+   */
+  template <class Fn> void range(const Key &lo, const Key &hi, Fn fn) {
+    for (Cursor it = lower_bound(lo); it.valid() && !(it.key() > hi);
+         it.next()) {
+      if (!fn(it.key(), it.value())) {
+        return;
+      }
+    }
+  }
+
+  /**
+   * @brief Call fn(key, value) for every entry whose key.first equals
+   * from.first, starting at from, for composite pair keys.
+   * @note Pass the smallest key of the prefix as from, e.g. {station, 0}, to
+   * visit all of it. fn returns false to stop the scan early.
+   */
+  template <class Fn> void for_each_prefix(const Key &from, Fn fn) {
+    for (Cursor it = lower_bound(from);
+         it.valid() && it.key().first == from.first; it.next()) {
+      if (!fn(it.key(), it.value())) {
+        return;
+      }
+    }
+  }
+
+  /**
+   * @brief Write every dirty page and the root index back to disk.
+   */
+  void flush() {
+    node_file.write_info(root_index, 1);
+    node_file.write_info(entry_count, 2);
+    node_file.flush();
+    data_file.flush();
+  }
+
+  /**
+   * @brief flush(), then make both files durable.
+   */
+  void sync() {
+    node_file.write_info(root_index, 1);
+    node_file.write_info(entry_count, 2);
+    node_file.sync();
+    data_file.sync();
+  }
+
+  /**
+   * @brief Rewrite both files densely, dropping the space of removed pages.
+   * @note Nodes are renumbered breadth first and blocks in leaf order. Meant to
+   * run offline, as it copies the whole tree.
+   */
+  void compact();
+
   /**
    * @brief Clear the B+ tree.
    */
   void clear() {
+    unpin_upper_levels();
     node_file.clear();
     data_file.clear();
     FileInit();
+    pin_upper_levels();
   }
 
   bool isEmpty = true;
 
 private:
-  FileOperation<NodeType, 2> node_file;
-  FileOperation<BlockType, 2> data_file;
+  PageManager<NodeType, 2> node_file;
+  PageManager<BlockType, 2> data_file;
 
   std::string node_file_name;
   std::string data_file_name;
   Key MAX_KEY;
 
   int root_index;
+  size_t entry_count; // kept in the second info int of the node file
 
   NodeType root_node;
 
+  size_t pinned_levels;
+  size_t pinned_limit; // in nodes
+  sjtu::vector<int> pinned_ids;
+
+  /**
+   * @brief Pin the top levels of the tree, breadth first, within the budget.
+   */
+  void pin_upper_levels();
+
+  /**
+   * @brief Release every pinned node.
+   * @note Called before any split or merge, which may move or free nodes.
+   * insert() and remove() pin the new upper levels once the tree is stable.
+   */
+  void unpin_upper_levels();
+
+  // Node ids from the root down to the leaf reached by the last descent.
+  // Splits and merges walk it upwards instead of storing parent pointers, the
+  // structural helpers below take the depth of their node in it.
+  sjtu::vector<int> path;
+
+  /**
+   * @brief Descend to the leaf that may hold key, recording the path.
+   */
   int find_leaf_node(Key key);
 
+  /**
+   * @brief Move the path to the next leaf in key order.
+   * @return the new leaf, or -1 if the path was at the last leaf.
+   */
+  int next_leaf();
+
   /**
    * @brief Insert a key-value pair into a leaf node.
    */
@@ -65,13 +267,14 @@ private:
 
   /**
    * @brief Delete a key-value pair from a leaf node.
+   * @return false if the pair is not in the tree.
    */
-  void delete_from_leaf_node(int index, Key key, Value value);
+  bool delete_from_leaf_node(int index, Key key, Value value);
 
   /**
    * @brief Merge two leaf nodes.
    */
-  void merge_nodes(int index);
+  void merge_nodes(int index, int depth);
 
   /**
    * @brief Split a node.
@@ -81,14 +284,15 @@ private:
    * 2. node isn't root. -> split, then call insert_into_internal_node for its
    * parents.
    */
-  void split_node(int index);
+  void split_node(int index, int depth);
 
   /**
    * @brief Insert a key and child index into an internal node.
    * @note This function would only be called in split_leaf_node or
    * split_internal_node
    */
-  void insert_into_internal_node(int index, Key key, int child_index, int pos);
+  void insert_into_internal_node(int index, Key key, int child_index, int pos,
+                                 int depth);
 
   /**
    * @brief Delete a key from an internal node.
@@ -101,133 +305,451 @@ private:
    * 3. node isn't root. -> Key <= NODE_SIZE / 2 -> Merge_nodes.
    * 4. node isn't root. -> Key > NODE_SIZE / 2 -> No Changes.
    */
-  void delete_from_internal_node(int index, int pos);
+  void delete_from_internal_node(int index, int pos, int depth);
 
   void FileInit();
-
-  sjtu::vector<Value> sort_result(sjtu::vector<Value> &vec);
 };
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::BPTStorage(
-    const std::string &file_prefix, const Key &MAX_KEY)
-    : MAX_KEY(MAX_KEY) {
-  node_file.initialise(file_prefix + "_node");
-  data_file.initialise(file_prefix + "_data");
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::BPTStorage(
+    const std::string &file_prefix, const Key &MAX_KEY, size_t pinned_levels,
+    size_t pinned_bytes)
+    : node_file_name(file_prefix + "_node"),
+      data_file_name(file_prefix + "_data"), MAX_KEY(MAX_KEY),
+      pinned_levels(pinned_levels) {
+  // Leave at least half of the pool to leaves and their neighbours.
+  pinned_limit = pinned_bytes / sizeof(NodeType);
+  if (pinned_limit > node_file.capacity() / 2) {
+    pinned_limit = node_file.capacity() / 2;
+  }
+  node_file.initialise(node_file_name);
+  data_file.initialise(data_file_name);
   FileInit();
+  pin_upper_levels();
 }
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::~BPTStorage() {
-  node_file.write_info(root_index, 1);
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::~BPTStorage() {
+  flush();
+  unpin_upper_levels();
 }
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::insert(Key key,
-                                                           Value value) {
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::insert(
+    Key key, Value value) {
   int leaf_index = find_leaf_node(key);
   insert_into_leaf_node(leaf_index, key, value);
+  entry_count++;
+  if (pinned_ids.empty()) {
+    pin_upper_levels();
+  }
 }
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::remove(Key key,
-                                                           Value value) {
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::remove(
+    Key key, Value value) {
   int leaf_index = find_leaf_node(key);
-  delete_from_leaf_node(leaf_index, key, value);
+  if (delete_from_leaf_node(leaf_index, key, value)) {
+    entry_count--;
+  }
+  if (pinned_ids.empty()) {
+    pin_upper_levels();
+  }
 }
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
 sjtu::vector<Value>
-BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::find(Key key) {
+BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::find(Key key) {
   sjtu::vector<Value> result;
-  int leaf_index = find_leaf_node(key);
-  NodeType leaf_node;
-  node_file.read(leaf_node, leaf_index);
+  range(key, key, [&result](const Key &, const Value &value) {
+    result.push_back(value);
+    return true;
+  });
+  return result;
+}
 
-  int i = 0;
-  while (i < leaf_node.key_count && key > leaf_node.keys[i]) {
-    i++;
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+typename BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::Cursor
+BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::lower_bound(
+    const Key &key) {
+  Cursor cursor(this);
+  int leaf_index = find_leaf_node(key);
+  const NodeType *leaf_node = node_file.pin(leaf_index);
+  int n = leaf_node->key_count;
+  if (n > 0) {
+    // Past the last separator the answer starts in a later leaf, which the
+    // block chain reaches from the last block of this one.
+    int i = leaf_node->lower_bound(key, n);
+    cursor.load(leaf_node->children[i < n ? i : n - 1]);
   }
+  node_file.unpin(leaf_index, false);
+
+  cursor.settle();
+  while (cursor.valid() && cursor.key() < key) {
+    const BlockType *block = cursor.block;
+    if (block->data[block->key_count - 1].first < key) {
+      cursor.pos = block->key_count; // skip the whole block
+      cursor.settle();
+    } else {
+      cursor.next();
+    }
+  }
+  return cursor;
+}
 
-  if (i < leaf_node.key_count) {
-    BlockType block;
-    data_file.read(block, leaf_node.children[i]);
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+typename BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::Cursor
+BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::begin() {
+  Cursor cursor(this);
+  int current_id = root_index;
+  const NodeType *current_node = node_file.pin(current_id);
+  while (!current_node->is_leaf) {
+    int child_id = current_node->children[0];
+    node_file.unpin(current_id, false);
+    current_id = child_id;
+    current_node = node_file.pin(current_id);
+  }
+  int first_block = current_node->children[0];
+  node_file.unpin(current_id, false);
+  if (first_block != -1) {
+    cursor.load(first_block);
+  }
+  cursor.settle();
+  return cursor;
+}
 
-    // Check current block
-    for (int j = 0; j < block.key_count; j++) {
-      if (block.data[j].first == key) {
-        result.push_back(block.data[j].second);
-      } else if (block.data[j].first > key) {
-        break;
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::insert_sorted(
+    const std::pair<Key, Value> *entries, size_t n) {
+  if (n < BLOCK_SIZE || entry_count > n * BPT_BULK_REBUILD_RATIO) {
+    for (size_t i = 0; i < n; i++) {
+      insert(entries[i].first, entries[i].second);
+    }
+    return;
+  }
+  unpin_upper_levels();
+  flush();
+
+  std::string node_tmp = node_file_name + ".bulk";
+  std::string data_tmp = data_file_name + ".bulk";
+  size_t total = 0;
+  {
+    FileOperation<NodeType, 2> nodes(node_tmp);
+    FileOperation<BlockType, 2> blocks(data_tmp);
+    nodes.initialise();
+    nodes.clear();
+    blocks.initialise();
+    blocks.clear();
+
+    // Blocks are appended back to back, so each one knows the id of the next.
+    // The (largest key, id) of every block forms the leaf level.
+    sjtu::vector<std::pair<Key, int>> level;
+    auto write_block = [&](BlockType &block, bool last) {
+      block.block_id = blocks.end_index();
+      block.next_block_id = last ? -1 : block.block_id + sizeof(BlockType);
+      blocks.append(block);
+      level.push_back(
+          {last ? MAX_KEY : block.data[block.key_count - 1].first,
+           block.block_id});
+    };
+
+    // A full block is held back until the next one starts, so that the last
+    // two can share their entries instead of ending on a nearly empty block.
+    BlockType held, block;
+    bool holding = false;
+    auto emit = [&](const Key &key, const Value &value) {
+      if (block.key_count == static_cast<int>(BLOCK_SIZE)) {
+        if (holding) {
+          write_block(held, false);
+        }
+        held = block;
+        holding = true;
+        block.key_count = 0;
+      }
+      block.data[block.key_count++] = {key, value};
+      total++;
+    };
+    {
+      Cursor old = begin();
+      size_t i = 0;
+      while (old.valid() || i < n) {
+        bool take_old =
+            old.valid() &&
+            (i == n || old.key() < entries[i].first ||
+             (old.key() == entries[i].first &&
+              !(entries[i].second < old.value())));
+        if (take_old) {
+          emit(old.key(), old.value());
+          old.next();
+        } else {
+          emit(entries[i].first, entries[i].second);
+          i++;
+        }
       }
     }
-
-    // Check linked blocks
-    while (block.next_block_id != -1) {
-      data_file.read(block, block.next_block_id);
-      if (block.key_count == 0)
-        continue;
-      if (block.data[0].first > key) {
-        break;
+    if (holding && block.key_count < static_cast<int>(BLOCK_SIZE) / 2) {
+      int move = (held.key_count - block.key_count) / 2;
+      for (int j = block.key_count - 1; j >= 0; j--) {
+        block.data[j + move] = block.data[j];
       }
-      if (block.data[block.key_count - 1].first < key) {
-        continue;
-      } else {
-        for (int j = 0; j < block.key_count; j++) {
-          if (block.data[j].first == key) {
-            result.push_back(block.data[j].second);
-          } else if (block.data[j].first > key) {
-            break;
-          }
+      for (int j = 0; j < move; j++) {
+        block.data[j] = held.data[held.key_count - move + j];
+      }
+      held.key_count -= move;
+      block.key_count += move;
+    }
+    if (holding) {
+      write_block(held, false);
+    }
+    write_block(block, true);
+
+    // Group each level into nodes of NODE_SIZE - 1 children, the most a node
+    // holds without splitting, spread evenly, until a single root is left.
+    bool is_leaf = true;
+    int root = -1;
+    while (root == -1) {
+      size_t count = level.size();
+      size_t parts = (count + NODE_SIZE - 2) / (NODE_SIZE - 1);
+      sjtu::vector<std::pair<Key, int>> parents;
+      size_t next = 0;
+      for (size_t p = 0; p < parts; p++) {
+        NodeType node;
+        node.is_leaf = is_leaf;
+        node.is_root = parts == 1;
+        node.key_count = count / parts + (p < count % parts ? 1 : 0);
+        for (size_t j = 0; j <= NODE_SIZE; j++) {
+          node.children[j] = -1;
+        }
+        for (int j = 0; j < node.key_count; j++, next++) {
+          node.keys[j] = level[next].first;
+          node.children[j] = level[next].second;
+        }
+        node.node_id = nodes.end_index();
+        nodes.append(node);
+        parents.push_back({node.keys[node.key_count - 1], node.node_id});
+      }
+      if (parts == 1) {
+        root = parents[0].second;
+      }
+      level = parents;
+      is_leaf = false;
+    }
+
+    int info;
+    nodes.write_info(root, 1);
+    nodes.write_info(total, 2);
+    data_file.get_info(info, 1);
+    blocks.write_info(info, 1);
+    data_file.get_info(info, 2);
+    blocks.write_info(info, 2);
+  }
+
+  node_file.replace_with(node_tmp);
+  data_file.replace_with(data_tmp);
+  FileInit();
+  pin_upper_levels();
+}
+
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::compact() {
+  unpin_upper_levels();
+  flush();
+
+  std::string node_tmp = node_file_name + ".compact";
+  std::string data_tmp = data_file_name + ".compact";
+  {
+    FileOperation<NodeType, 2> nodes(node_tmp);
+    FileOperation<BlockType, 2> blocks(data_tmp);
+    nodes.initialise();
+    nodes.clear();
+    blocks.initialise();
+    blocks.clear();
+
+    // Copy live nodes breadth first and live blocks in leaf order.
+    sjtu::map<int, int> node_map, block_map;
+    sjtu::vector<int> order;
+    order.push_back(root_index);
+    for (size_t head = 0; head < order.size(); head++) {
+      NodeType node;
+      node_file.read(node, order[head]);
+      node_map[order[head]] = nodes.append(node);
+      for (int i = 0; i < node.key_count; i++) {
+        int child = node.children[i];
+        if (!node.is_leaf) {
+          order.push_back(child);
+        } else if (child != -1 && block_map.count(child) == 0) {
+          BlockType block;
+          data_file.read(block, child);
+          block_map[child] = blocks.append(block);
         }
       }
     }
+
+    auto remap = [](const sjtu::map<int, int> &map, int id) {
+      auto it = map.find(id);
+      return it == map.cend() ? -1 : (*it).second;
+    };
+    for (auto it = node_map.cbegin(); it != node_map.cend(); ++it) {
+      NodeType node;
+      nodes.read(node, (*it).second);
+      node.node_id = (*it).second;
+      for (int i = 0; i < node.key_count; i++) {
+        node.children[i] = remap(node.is_leaf ? block_map : node_map,
+                                 node.children[i]);
+      }
+      nodes.update(node, (*it).second);
+    }
+    for (auto it = block_map.cbegin(); it != block_map.cend(); ++it) {
+      BlockType block;
+      blocks.read(block, (*it).second);
+      block.block_id = (*it).second;
+      block.next_block_id = remap(block_map, block.next_block_id);
+      blocks.update(block, (*it).second);
+    }
+
+    int info;
+    node_file.get_info(info, 2);
+    nodes.write_info(info, 2);
+    nodes.write_info(node_map[root_index], 1);
+    data_file.get_info(info, 1);
+    blocks.write_info(info, 1);
+    data_file.get_info(info, 2);
+    blocks.write_info(info, 2);
   }
-  return sort_result(result);
+
+  node_file.replace_with(node_tmp);
+  data_file.replace_with(data_tmp);
+  FileInit();
+  pin_upper_levels();
 }
 
 /**
  * Begin of private methods
  */
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-int BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::find_leaf_node(Key key) {
-  node_file.read(root_node, root_index);
-  NodeType current_node = root_node;
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE,
+                PageManager>::pin_upper_levels() {
+  sjtu::vector<int> level;
+  level.push_back(root_index);
+  for (size_t depth = 0; depth < pinned_levels && !level.empty(); depth++) {
+    sjtu::vector<int> next_level;
+    for (size_t i = 0; i < level.size(); i++) {
+      if (pinned_ids.size() >= pinned_limit) {
+        return;
+      }
+      const NodeType *node = node_file.pin(level[i]);
+      pinned_ids.push_back(level[i]);
+      if (!node->is_leaf) {
+        for (int j = 0; j < node->key_count; j++) {
+          next_level.push_back(node->children[j]);
+        }
+      }
+    }
+    level = next_level;
+  }
+}
+
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE,
+                PageManager>::unpin_upper_levels() {
+  for (size_t i = 0; i < pinned_ids.size(); i++) {
+    node_file.unpin(pinned_ids[i], false);
+  }
+  pinned_ids.clear();
+}
+
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+int
+BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::find_leaf_node(
+    Key key) {
   int current_id = root_index;
+  const NodeType *current_node = node_file.pin(current_id);
+  path.clear();
+  path.push_back(current_id);
+
+  while (!current_node->is_leaf) {
+    int child_index =
+        current_node->lower_bound(key, current_node->key_count - 1);
+    int child_id = current_node->children[child_index];
+    node_file.unpin(current_id, false);
+    current_id = child_id;
+    current_node = node_file.pin(current_id);
+    path.push_back(current_id);
+  }
+  node_file.unpin(current_id, false);
+
+  return current_id;
+}
 
-  while (!current_node.is_leaf) {
-    int child_index = 0;
-    while (child_index < current_node.key_count - 1 &&
-           key > current_node.keys[child_index]) {
-      child_index++;
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+int BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::next_leaf() {
+  // Climb to the lowest ancestor with a right sibling of the path below it.
+  int level = path.size() - 1;
+  while (level > 0) {
+    const NodeType *parent = node_file.pin(path[level - 1]);
+    int j = 0;
+    while (j < parent->key_count && parent->children[j] != path[level]) {
+      j++;
     }
-    int child_id = current_node.children[child_index];
-    current_id = child_id;
-    node_file.read(current_node, child_id);
+    int sibling = j + 1 < parent->key_count ? parent->children[j + 1] : -1;
+    node_file.unpin(path[level - 1], false);
+    if (sibling != -1) {
+      while (static_cast<int>(path.size()) > level) {
+        path.pop_back();
+      }
+      path.push_back(sibling);
+      break;
+    }
+    level--;
+  }
+  if (level == 0) {
+    return -1;
   }
 
+  // Then take leftmost children down to the leaf level.
+  int current_id = path.back();
+  const NodeType *current_node = node_file.pin(current_id);
+  while (!current_node->is_leaf) {
+    int child_id = current_node->children[0];
+    node_file.unpin(current_id, false);
+    current_id = child_id;
+    current_node = node_file.pin(current_id);
+    path.push_back(current_id);
+  }
+  node_file.unpin(current_id, false);
   return current_id;
 }
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::insert_into_leaf_node(
-    int index, Key key, Value value) {
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE,
+                PageManager>::insert_into_leaf_node(int index, Key key,
+                                                    Value value) {
 
   NodeType node;
   node_file.read(node, index);
   // insert
-  int i = 0;
-  while (i < node.key_count && key > node.keys[i]) {
-    i++;
-  }
+  int i = node.lower_bound(key, node.key_count);
   isEmpty = false;
 
   BlockType block;
   if (node.children[i] == -1) {
     // create a new block
     block.block_id = data_file.write(block);
-    block.parent_id = index;
     block.key_count = 0;
     node.children[i] = block.block_id;
     node.keys[i] = key;
@@ -245,6 +767,51 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::insert_into_leaf_node(
   } else {
     // read the existing block
     data_file.read(block, node.children[i]);
+
+    // Equal keys can run over several blocks, as a split leaves the next block
+    // starting with the separator. Walk on while the next non-empty block
+    // still starts below the new pair, so the chain stays sorted by
+    // (key, value).
+    auto next_starts_below = [&]() {
+      if (node.keys[i] != key) {
+        return false; // later blocks start above key
+      }
+      if (block.key_count > 0) {
+        const auto &last = block.data[block.key_count - 1];
+        if (key < last.first || (last.first == key && value < last.second)) {
+          return false; // the pair lands inside this block
+        }
+      }
+      int next_id = block.next_block_id;
+      while (next_id != -1) {
+        const BlockType *next = data_file.pin(next_id);
+        int count = next->key_count;
+        bool below = count > 0 && next->data[0].first == key &&
+                     next->data[0].second < value;
+        int after = next->next_block_id;
+        data_file.unpin(next_id, false);
+        if (count > 0) {
+          return below;
+        }
+        next_id = after;
+      }
+      return false;
+    };
+    while (next_starts_below()) {
+      if (i + 1 < node.key_count) {
+        i++;
+      } else {
+        // The next block opens the next leaf, which takes the path along.
+        int next_index = next_leaf();
+        if (next_index == -1) {
+          break;
+        }
+        index = next_index;
+        node_file.read(node, index);
+        i = 0;
+      }
+      data_file.read(block, node.children[i]);
+    }
   }
 
   auto [need_split, new_block] = block.insert_key(key, value);
@@ -252,7 +819,6 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::insert_into_leaf_node(
   if (need_split) {
     // Write new block
     new_block.block_id = data_file.write(new_block);
-    new_block.parent_id = index;
     block.next_block_id = new_block.block_id;
     data_file.update(block, block.block_id);
     data_file.update(new_block, new_block.block_id);
@@ -270,7 +836,7 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::insert_into_leaf_node(
     node_file.update(node, node.node_id);
 
     if (node.key_count >= NODE_SIZE) {
-      split_node(index);
+      split_node(index, path.size() - 1);
     }
   } else {
     node_file.update(node, node.node_id);
@@ -278,21 +844,21 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::insert_into_leaf_node(
   }
 }
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::delete_from_leaf_node(
-    int index, Key key, Value value) {
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+bool BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE,
+                PageManager>::delete_from_leaf_node(int index, Key key,
+                                                    Value value) {
   NodeType node;
   node_file.read(node, index);
-  int i = 0;
-  while (i < node.key_count && key > node.keys[i]) {
-    i++;
-  }
+  int i = node.lower_bound(key, node.key_count);
   if (i == node.key_count) {
     // key not found
-    return;
+    return false;
   }
   BlockType block;
   bool deleted = false, need_merge = false;
+  bool owned = true; // node.children[i] is block
   data_file.read(block, node.children[i]);
   std::tie(deleted, need_merge) = block.delete_key(key, value);
   if (!deleted) {
@@ -310,18 +876,34 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::delete_from_leaf_node(
       }
       std::tie(deleted, need_merge) = block.delete_key(key, value);
       if (deleted) {
-        index = block.parent_id;
-        node_file.read(node, block.parent_id);
-        i = 0;
-        while (i < node.key_count && node.children[i] != block.block_id) {
-          i++;
+        // The chain follows leaf order, so the owner is this leaf or a later
+        // one; walking there also moves the path along.
+        while (true) {
+          i = 0;
+          while (i < node.key_count && node.children[i] != block.block_id) {
+            i++;
+          }
+          if (i < node.key_count) {
+            break;
+          }
+          int next_index = next_leaf();
+          if (next_index == -1) {
+            // No leaf points at the block: the tree is inconsistent, so keep
+            // the deletion but leave the leaves as they are.
+            owned = false;
+            assert(owned && "no leaf owns the block of a deleted entry");
+            break;
+          }
+          index = next_index;
+          node_file.read(node, index);
         }
         break;
       }
     }
   }
 
-  if (deleted && need_merge && i != node.key_count - 1 && !node.is_root) {
+  if (deleted && need_merge && owned && i != node.key_count - 1 &&
+      !node.is_root) {
     BlockType next_block;
     data_file.read(next_block, block.next_block_id);
     if (next_block.key_count > BLOCK_SIZE / 2) {
@@ -345,7 +927,7 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::delete_from_leaf_node(
       data_file.update(block, block.block_id);
       if (node.key_count <= NODE_SIZE / 3) {
         node_file.update(node, node.node_id);
-        merge_nodes(index);
+        merge_nodes(index, path.size() - 1);
       } else {
         node_file.update(node, node.node_id);
       }
@@ -354,17 +936,22 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::delete_from_leaf_node(
     // write the block back
     data_file.update(block, block.block_id);
   }
+  return deleted;
 }
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::merge_nodes(int index) {
-  NodeType node;
-  node_file.read(node, index);
-  if (node.parent_id == -1) {
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void
+BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::merge_nodes(
+    int index, int depth) {
+  unpin_upper_levels();
+  if (depth == 0) {
     return;
   }
+  NodeType node;
+  node_file.read(node, index);
   NodeType parent_node;
-  node_file.read(parent_node, node.parent_id);
+  node_file.read(parent_node, path[depth - 1]);
   int j = 0;
   while (parent_node.children[j] != index && j < parent_node.key_count) {
     j++;
@@ -383,18 +970,6 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::merge_nodes(int index) {
       node.keys[0] = left.keys[left.key_count - 1];
       node.children[0] = left.children[left.key_count - 1];
 
-      if (!node.is_leaf) {
-        NodeType child_node;
-        node_file.read(child_node, node.children[0]);
-        child_node.parent_id = node.node_id;
-        node_file.update(child_node, node.children[0]);
-      } else {
-        BlockType child_block;
-        data_file.read(child_block, node.children[0]);
-        child_block.parent_id = node.node_id;
-        data_file.update(child_block, node.children[0]);
-      }
-
       node.key_count++;
       left.key_count--;
       parent_node.keys[j - 1] = left.keys[left.key_count - 1];
@@ -416,18 +991,6 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::merge_nodes(int index) {
         right.children[k] = right.children[k + 1];
       }
 
-      if (!node.is_leaf) {
-        NodeType child_node;
-        node_file.read(child_node, node.children[node.key_count]);
-        child_node.parent_id = node.node_id;
-        node_file.update(child_node, node.children[node.key_count]);
-      } else {
-        BlockType child_block;
-        data_file.read(child_block, node.children[node.key_count]);
-        child_block.parent_id = node.node_id;
-        data_file.update(child_block, node.children[node.key_count]);
-      }
-
       node.key_count++;
       right.key_count--;
       parent_node.keys[j] = node.keys[node.key_count - 1];
@@ -443,17 +1006,6 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::merge_nodes(int index) {
     for (int k = 0; k < node.key_count; k++) {
       left.keys[k + left.key_count] = node.keys[k];
       left.children[k + left.key_count] = node.children[k];
-      if (!node.is_leaf) {
-        NodeType child;
-        node_file.read(child, node.children[k]);
-        child.parent_id = left.node_id;
-        node_file.update(child, child.node_id);
-      } else {
-        BlockType child_block;
-        data_file.read(child_block, node.children[k]);
-        child_block.parent_id = left.node_id;
-        data_file.update(child_block, child_block.block_id);
-      }
     }
 
     left.key_count += node.key_count;
@@ -462,7 +1014,7 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::merge_nodes(int index) {
     node_file.update(left, left.node_id);
     node_file.remove(node.node_id);
 
-    delete_from_internal_node(parent_node.node_id, j);
+    delete_from_internal_node(parent_node.node_id, j, depth - 1);
     return;
   }
   if (j <= parent_node.key_count - 2) {
@@ -470,17 +1022,6 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::merge_nodes(int index) {
     for (int k = 0; k < right.key_count; k++) {
       node.keys[k + node.key_count] = right.keys[k];
       node.children[k + node.key_count] = right.children[k];
-      if (!right.is_leaf) {
-        NodeType child;
-        node_file.read(child, right.children[k]);
-        child.parent_id = node.node_id;
-        node_file.update(child, child.node_id);
-      } else {
-        BlockType child_block;
-        data_file.read(child_block, right.children[k]);
-        child_block.parent_id = node.node_id;
-        data_file.update(child_block, child_block.block_id);
-      }
     }
 
     node.key_count += right.key_count;
@@ -491,13 +1032,17 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::merge_nodes(int index) {
     node_file.update(parent_node, parent_node.node_id);
     node_file.remove(right.node_id);
 
-    delete_from_internal_node(parent_node.node_id, j);
+    delete_from_internal_node(parent_node.node_id, j, depth - 1);
     return;
   }
 }
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::split_node(int index) {
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void
+BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::split_node(
+    int index, int depth) {
+  unpin_upper_levels();
   NodeType node;
   node_file.read(node, index);
   if (node.is_root) {
@@ -526,41 +1071,6 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::split_node(int index) {
     child_1.is_leaf = child_2.is_leaf = node.is_leaf;
     node.is_leaf = false;
 
-    child_1.parent_id = node.node_id;
-    child_2.parent_id = node.node_id;
-
-    if (!child_1.is_leaf) {
-      for (int j = 0; j < child_1.key_count; j++) {
-        NodeType child_node;
-        node_file.read(child_node, child_1.children[j]);
-        child_node.parent_id = child_1.node_id;
-        node_file.update(child_node, child_1.children[j]);
-      }
-    } else {
-      for (int j = 0; j < child_1.key_count; j++) {
-        BlockType child_block;
-        data_file.read(child_block, child_1.children[j]);
-        child_block.parent_id = child_1.node_id;
-        data_file.update(child_block, child_1.children[j]);
-      }
-    }
-
-    if (!child_2.is_leaf) {
-      for (int j = 0; j < child_2.key_count; j++) {
-        NodeType child_node;
-        node_file.read(child_node, child_2.children[j]);
-        child_node.parent_id = child_2.node_id;
-        node_file.update(child_node, child_2.children[j]);
-      }
-    } else {
-      for (int j = 0; j < child_2.key_count; j++) {
-        BlockType child_block;
-        data_file.read(child_block, child_2.children[j]);
-        child_block.parent_id = child_2.node_id;
-        data_file.update(child_block, child_2.children[j]);
-      }
-    }
-
     node_file.update(child_1, child_1.node_id);
     node_file.update(child_2, child_2.node_id);
     node_file.update(node, node.node_id);
@@ -573,30 +1083,14 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::split_node(int index) {
       new_node.keys[j] = node.keys[j + mid];
     }
     new_node.is_leaf = node.is_leaf;
-    new_node.parent_id = node.parent_id;
     node.key_count = mid;
     new_node.node_id = node_file.write(new_node);
     node_file.update(node, node.node_id);
     node_file.update(new_node, new_node.node_id);
 
-    if (!new_node.is_leaf) {
-      for (int i = 0; i < new_node.key_count; i++) {
-        NodeType child;
-        node_file.read(child, new_node.children[i]);
-        child.parent_id = new_node.node_id;
-        node_file.update(child, child.node_id);
-      }
-    } else {
-      for (int i = 0; i < new_node.key_count; i++) {
-        BlockType child;
-        data_file.read(child, new_node.children[i]);
-        child.parent_id = new_node.node_id;
-        data_file.update(child, child.block_id);
-      }
-    }
-
+    int parent_index = path[depth - 1];
     NodeType parent_node;
-    node_file.read(parent_node, node.parent_id);
+    node_file.read(parent_node, parent_index);
 
     int j = 0;
     while (parent_node.children[j] != index && j < parent_node.key_count) {
@@ -606,14 +1100,17 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::split_node(int index) {
     parent_node.keys[j] = node.keys[node.key_count - 1];
     node_file.update(parent_node, parent_node.node_id);
 
-    insert_into_internal_node(node.parent_id, original_key, new_node.node_id,
-                              j + 1);
+    insert_into_internal_node(parent_index, original_key, new_node.node_id,
+                              j + 1, depth - 1);
   }
 }
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::insert_into_internal_node(
-    int index, Key key, int child_index, int pos) {
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE,
+                PageManager>::insert_into_internal_node(int index, Key key,
+                                                        int child_index,
+                                                        int pos, int depth) {
   NodeType node;
   node_file.read(node, index);
 
@@ -628,13 +1125,15 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::insert_into_internal_node(
   node_file.update(node, node.node_id);
 
   if (node.key_count >= NODE_SIZE) {
-    split_node(index);
+    split_node(index, depth);
   }
 }
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::delete_from_internal_node(
-    int index, int pos) {
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE,
+                PageManager>::delete_from_internal_node(int index, int pos,
+                                                        int depth) {
   NodeType node;
   node_file.read(node, index);
   if (node.is_root) {
@@ -652,7 +1151,6 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::delete_from_internal_node(
       NodeType child_node;
       node_file.read(child_node, preserved_child);
       child_node.is_root = true;
-      child_node.parent_id = -1;
       node_file.remove(node.node_id);
       root_node = child_node;
       root_index = child_node.node_id;
@@ -671,17 +1169,17 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::delete_from_internal_node(
       node.keys[node.key_count - 1] = MAX_KEY;
     if (node.key_count <= NODE_SIZE / 3) {
       node_file.update(node, node.node_id);
-      merge_nodes(index);
+      merge_nodes(index, depth);
     } else {
       node_file.update(node, node.node_id);
     }
   }
 }
 
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::FileInit() {
+template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE,
+          template <class, int> class PageManager>
+void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE, PageManager>::FileInit() {
   if (node_file.isEmpty()) {
-    root_node.parent_id = -1;
     root_node.is_leaf = true;
     root_node.is_root = true;
     root_node.key_count = 1;
@@ -700,51 +1198,17 @@ void BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::FileInit() {
     node_file.update(root_node, root_index);
 
     node_file.write_info(root_index, 1);
+    node_file.write_info(0, 2);
+    entry_count = 0;
     isEmpty = true;
   } else {
+    int count;
     node_file.get_info(root_index, 1);
+    node_file.get_info(count, 2);
+    entry_count = count;
     node_file.read(root_node, root_index);
     isEmpty = false;
   }
 }
 
-
-template <typename Key, typename Value, size_t NODE_SIZE, size_t BLOCK_SIZE>
-sjtu::vector<Value> BPTStorage<Key, Value, NODE_SIZE, BLOCK_SIZE>::sort_result(
-    sjtu::vector<Value> &vec) {
-  if (vec.size() <= 1)
-    return vec;
-
-  auto partition = [&vec](int low, int high) {
-    Value pivot = vec[high];
-    int i = low - 1;
-
-    for (int j = low; j < high; j++) {
-      if (vec[j] <= pivot) {
-        i++;
-        Value temp = vec[i];
-        vec[i] = vec[j];
-        vec[j] = temp;
-      }
-    }
-
-    Value temp = vec[i + 1];
-    vec[i + 1] = vec[high];
-    vec[high] = temp;
-
-    return i + 1;
-  };
-
-  std::function<void(int, int)> quicksort = [&](int low, int high) {
-    if (low < high) {
-      int pi = partition(low, high);
-      quicksort(low, pi - 1);
-      quicksort(pi + 1, high);
-    }
-  };
-
-  quicksort(0, vec.size() - 1);
-  return vec;
-}
-
 #endif // BPT_STORAGE_HPP
\ No newline at end of file
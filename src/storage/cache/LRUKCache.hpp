@@ -1,23 +1,45 @@
 #ifndef LRUK_CACHE_HPP
 #define LRUK_CACHE_HPP
 
-#include "stl/map.hpp"
 #include <cassert>
 #include <cstddef>
-#include <limits>
+#include <functional>
 
+constexpr std::size_t lruk_ceil_log2(std::size_t n) {
+  std::size_t bits = 0;
+  while ((std::size_t(1) << bits) < n) {
+    bits++;
+  }
+  return bits;
+}
+
+/**
+ * @brief Fixed-capacity LRU-K cache.
+ * @note Entries live in preallocated slot arrays. A chained hash index maps
+ * keys to slots and an indexed binary min-heap orders the unpinned slots by
+ * backward K-distance, so lookup is O(1) on average and touch/evict are
+ * O(log MaxResidency). Entries seen fewer than K times have infinite
+ * K-distance and are evicted first, least recently used among them.
+ */
 template <class Key, class Value, std::size_t K = 4,
-          std::size_t MaxResidency = 8192>
+          std::size_t MaxResidency = 8192, class Hash = std::hash<Key>>
 class LRUKCache {
   static_assert(K >= 1, "K must be at least 1");
   static_assert(MaxResidency > 0, "MaxResidency must be greater than 0");
 
+  static constexpr int NIL = -1;
+  static constexpr std::size_t BUCKET_BITS = lruk_ceil_log2(MaxResidency * 2);
+  static constexpr std::size_t BUCKETS = std::size_t(1) << BUCKET_BITS;
+
   struct Entry {
-    Value val;
+    Key key;
     bool dirty = false;
+    std::size_t pins = 0;
     std::size_t hist[K];
     std::size_t hist_count = 0;
     std::size_t hist_head = 0;
+    int next = NIL;     // hash chain, or free list when the slot is unused
+    int heap_pos = NIL; // NIL while pinned or unused
 
     void push_history(std::size_t time) {
       std::size_t tail = (hist_head + hist_count) % K;
@@ -35,104 +57,328 @@ class LRUKCache {
       }
       return hist[hist_head];
     }
+
+    std::size_t get_last_history() const {
+      return hist[(hist_head + hist_count - 1) % K];
+    }
   };
 
-  sjtu::map<Key, Entry> map;
+  // Heap items carry their ordering key so sifting stays within the heap.
+  struct HeapItem {
+    std::size_t kth;
+    std::size_t last;
+    int slot;
+  };
+
+  Entry *slots;
+  Value *values;
+  int *buckets;
+  HeapItem *heap;
+  std::size_t heap_size = 0;
+  std::size_t resident = 0;
+  int free_head = 0;
+
   std::size_t clk = 0;
   void (*writer)(const Key &, const Value &, void *) = nullptr;
   void *writer_context = nullptr;
+  Hash hasher;
+
+  std::size_t bucket_of(const Key &k) const {
+    // Fibonacci hashing spreads the dense integer keys we see in practice.
+    return (static_cast<std::size_t>(hasher(k)) * 11400714819323198485ull) >>
+           (64 - BUCKET_BITS);
+  }
+
+  int lookup(const Key &k) const {
+    for (int i = buckets[bucket_of(k)]; i != NIL; i = slots[i].next) {
+      if (slots[i].key == k) {
+        return i;
+      }
+    }
+    return NIL;
+  }
+
+  void unlink(int slot) {
+    int *link = &buckets[bucket_of(slots[slot].key)];
+    while (*link != slot) {
+      link = &slots[*link].next;
+    }
+    *link = slots[slot].next;
+  }
+
+  static bool before(const HeapItem &a, const HeapItem &b) {
+    if (a.kth != b.kth) {
+      return a.kth < b.kth;
+    }
+    return a.last < b.last;
+  }
 
-  void touch(Entry &e) { e.push_history(++clk); }
+  HeapItem heap_item(int slot) const {
+    return {slots[slot].get_kth_history(), slots[slot].get_last_history(),
+            slot};
+  }
 
-  std::size_t kth(const Entry &e) const { return e.get_kth_history(); }
+  void heap_place(std::size_t pos, const HeapItem &item) {
+    heap[pos] = item;
+    slots[item.slot].heap_pos = static_cast<int>(pos);
+  }
 
-  void evict() {
-    assert(!map.empty());
-    typename sjtu::map<Key, Entry>::iterator victim_it = map.end();
-    std::size_t min_time = std::numeric_limits<std::size_t>::max();
+  void sift_up(std::size_t pos, HeapItem item) {
+    while (pos > 0) {
+      std::size_t parent = (pos - 1) / 2;
+      if (!before(item, heap[parent])) {
+        break;
+      }
+      heap_place(pos, heap[parent]);
+      pos = parent;
+    }
+    heap_place(pos, item);
+  }
 
-    for (auto it = map.begin(); it != map.end(); ++it) {
-      std::size_t current_kth_time = kth(it->second);
-      if (current_kth_time < min_time) {
-        min_time = current_kth_time;
-        victim_it = it;
+  void sift_down(std::size_t pos, HeapItem item) {
+    while (true) {
+      std::size_t child = pos * 2 + 1;
+      if (child >= heap_size) {
+        break;
       }
+      if (child + 1 < heap_size && before(heap[child + 1], heap[child])) {
+        child++;
+      }
+      if (!before(heap[child], item)) {
+        break;
+      }
+      heap_place(pos, heap[child]);
+      pos = child;
     }
+    heap_place(pos, item);
+  }
 
-    assert(victim_it != map.end());
-    if (victim_it == map.end())
+  void heap_push(int slot) { sift_up(heap_size++, heap_item(slot)); }
+
+  void heap_erase(int slot) {
+    std::size_t pos = slots[slot].heap_pos;
+    slots[slot].heap_pos = NIL;
+    if (--heap_size == pos) {
       return;
+    }
+    HeapItem moved = heap[heap_size];
+    if (pos > 0 && before(moved, heap[(pos - 1) / 2])) {
+      sift_up(pos, moved);
+    } else {
+      sift_down(pos, moved);
+    }
+  }
+
+  void touch(int slot) {
+    // A new access can only move the K-th history forward.
+    slots[slot].push_history(++clk);
+    if (slots[slot].heap_pos != NIL) {
+      sift_down(slots[slot].heap_pos, heap_item(slot));
+    }
+  }
+
+  void release(int slot) {
+    if (slots[slot].heap_pos != NIL) {
+      heap_erase(slot);
+    }
+    unlink(slot);
+    slots[slot].next = free_head;
+    free_head = slot;
+    resident--;
+  }
+
+  /**
+   * @return false if every resident entry is pinned, so none can be evicted.
+   */
+  bool evict() {
+    if (heap_size == 0) {
+      return false;
+    }
+
+    int victim = heap[0].slot;
+    if (slots[victim].dirty && writer) {
+      writer(slots[victim].key, values[victim], writer_context);
+    }
+    release(victim);
+    return true;
+  }
+
+  template <class Fn> void for_each_resident(Fn fn) {
+    for (std::size_t b = 0; b < BUCKETS; ++b) {
+      for (int i = buckets[b]; i != NIL; i = slots[i].next) {
+        fn(i);
+      }
+    }
+  }
 
-    if (victim_it->second.dirty && writer) {
-      writer(victim_it->first, victim_it->second.val, writer_context);
+  void reset() {
+    for (std::size_t b = 0; b < BUCKETS; ++b) {
+      buckets[b] = NIL;
     }
-    map.erase(victim_it);
+    for (std::size_t i = 0; i < MaxResidency; ++i) {
+      slots[i].next = i + 1 < MaxResidency ? static_cast<int>(i + 1) : NIL;
+      slots[i].heap_pos = NIL;
+    }
+    free_head = 0;
+    heap_size = 0;
+    resident = 0;
   }
 
 public:
   explicit LRUKCache(void (*wb)(const Key &, const Value &, void *),
                      void *context)
-      : writer(wb), writer_context(context) {}
+      : slots(new Entry[MaxResidency]), values(new Value[MaxResidency]),
+        buckets(new int[BUCKETS]), heap(new HeapItem[MaxResidency]),
+        writer(wb), writer_context(context) {
+    reset();
+  }
 
-  ~LRUKCache() = default;
+  ~LRUKCache() {
+    delete[] slots;
+    delete[] values;
+    delete[] buckets;
+    delete[] heap;
+  }
 
   LRUKCache(const LRUKCache &) = delete;
   LRUKCache &operator=(const LRUKCache &) = delete;
   LRUKCache(LRUKCache &&) = delete;
   LRUKCache &operator=(LRUKCache &&) = delete;
 
-  bool contains(const Key &k) const { return map.count(k) > 0; }
+  bool contains(const Key &k) const { return lookup(k) != NIL; }
+
+  std::size_t size() const { return resident; }
 
   bool get(const Key &k, Value &out) {
-    auto it = map.find(k);
-    if (it == map.end()) {
+    int slot = lookup(k);
+    if (slot == NIL) {
       return false;
     }
-    touch(it->second);
-    out = it->second.val;
+    touch(slot);
+    out = values[slot];
     return true;
   }
 
-  void put(const Key &k, const Value &v, bool dirty) {
-    auto it = map.find(k);
-    if (it != map.end()) {
-      it->second.val = v;
-      it->second.dirty = dirty;
-      touch(it->second);
-    } else {
-      if (map.size() >= MaxResidency) {
-        evict();
+  /**
+   * @brief Cache v under k; dirty marks it for write-back, and a clean put()
+   * never clears a write-back still pending on k.
+   * @return false if k is not resident and every frame is pinned. v is then
+   * not cached, and if dirty it is handed straight to the writer.
+   */
+  bool put(const Key &k, const Value &v, bool dirty) {
+    int slot = lookup(k);
+    if (slot != NIL) {
+      values[slot] = v;
+      slots[slot].dirty |= dirty;
+      touch(slot);
+      return true;
+    }
+    if (resident >= MaxResidency && !evict()) {
+      if (dirty && writer) {
+        writer(k, v, writer_context);
       }
-      Entry &new_entry = map[k];
-      new_entry.val = v;
-      new_entry.dirty = dirty;
-      touch(new_entry);
+      return false;
+    }
+    slot = free_head;
+    free_head = slots[slot].next;
+    resident++;
+
+    Entry &new_entry = slots[slot];
+    new_entry.key = k;
+    values[slot] = v;
+    new_entry.dirty = dirty;
+    new_entry.pins = 0;
+    new_entry.hist_count = 0;
+    new_entry.hist_head = 0;
+    new_entry.push_history(++clk);
+
+    std::size_t b = bucket_of(k);
+    new_entry.next = buckets[b];
+    buckets[b] = slot;
+    heap_push(slot);
+    return true;
+  }
+
+  /**
+   * @brief Pin a resident entry so that it is never chosen for eviction.
+   * @return pointer to the cached value, stable until the matching unpin(), or
+   * nullptr if the key is not resident.
+   */
+  Value *pin(const Key &k) {
+    int slot = lookup(k);
+    if (slot == NIL) {
+      return nullptr;
+    }
+    touch(slot);
+    if (slots[slot].pins++ == 0) {
+      heap_erase(slot);
+    }
+    return &values[slot];
+  }
+
+  void unpin(const Key &k, bool dirty) {
+    int slot = lookup(k);
+    if (slot == NIL) {
+      return;
+    }
+    assert(slots[slot].pins > 0);
+    if (dirty) {
+      slots[slot].dirty = true;
+    }
+    if (--slots[slot].pins == 0) {
+      heap_push(slot);
+    }
+  }
+
+  /**
+   * @brief Drop an entry without writing it back.
+   */
+  void erase(const Key &k) {
+    int slot = lookup(k);
+    if (slot != NIL) {
+      assert(slots[slot].pins == 0);
+      release(slot);
     }
   }
 
   void mark_dirty(const Key &k) {
-    auto it = map.find(k);
-    if (it != map.end()) {
-      it->second.dirty = true;
+    int slot = lookup(k);
+    if (slot != NIL) {
+      slots[slot].dirty = true;
     }
   }
 
   void flush() {
-    for (auto it = map.begin(); it != map.end(); ++it) {
-      if (it->second.dirty && writer) {
-        writer(it->first, it->second.val, writer_context);
-        it->second.dirty = false;
+    for_each_resident([this](int slot) {
+      if (slots[slot].dirty && writer) {
+        writer(slots[slot].key, values[slot], writer_context);
+        slots[slot].dirty = false;
       }
-    }
+    });
   }
 
-  void clear() {
-    for (auto it = map.begin(); it != map.end(); ++it) {
-      if (it->second.dirty && writer) {
-        writer(it->first, it->second.val, writer_context);
+  /**
+   * @brief Hand every dirty entry to fn(key, value) and mark it clean.
+   * @note Values stay in place until the next put(), so fn may keep pointers
+   * to them and write them out as one batch.
+   */
+  template <class Fn> void take_dirty(Fn fn) {
+    for_each_resident([this, &fn](int slot) {
+      if (slots[slot].dirty) {
+        fn(slots[slot].key, values[slot]);
+        slots[slot].dirty = false;
       }
-    }
-    map.clear();
+    });
   }
+
+  void clear() {
+    flush();
+    reset();
+  }
+
+  /**
+   * @brief Drop every entry without writing it back.
+   */
+  void discard() { reset(); }
 };
-#endif // LRUK_CACHE_HPP
\ No newline at end of file
+#endif // LRUK_CACHE_HPP
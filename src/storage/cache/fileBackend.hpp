@@ -0,0 +1,283 @@
+#ifndef FILE_BACKEND_HPP
+#define FILE_BACKEND_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * @brief Byte-addressed file over a descriptor, one pread/pwrite per access.
+ */
+class PosixFile {
+private:
+  int fd = -1;
+  std::size_t length = 0;
+
+public:
+  PosixFile() = default;
+  PosixFile(const PosixFile &) = delete;
+  PosixFile &operator=(const PosixFile &) = delete;
+
+  ~PosixFile() { close(); }
+
+  /**
+   * @brief Open name for reading and writing, creating it if missing.
+   */
+  void open(const std::string &name) {
+    close();
+    fd = ::open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    length = st.st_size;
+  }
+
+  void close() {
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  std::size_t size() const { return length; }
+
+  void read(std::size_t offset, void *dst, std::size_t n) {
+    char *p = static_cast<char *>(dst);
+    while (n > 0) {
+      ssize_t got = pread(fd, p, n, offset);
+      if (got <= 0) {
+        std::memset(p, 0, n); // past the end, as a short fstream read
+        return;
+      }
+      p += got;
+      offset += got;
+      n -= got;
+    }
+  }
+
+  void write(std::size_t offset, const void *src, std::size_t n) {
+    iovec iov = {const_cast<void *>(src), n};
+    writev(offset, &iov, 1);
+  }
+
+  /**
+   * @brief Write the buffers back to back from offset in as few calls as the
+   * kernel allows.
+   */
+  void writev(std::size_t offset, iovec *iov, int count) {
+    std::size_t end = offset;
+    for (int i = 0; i < count; i++) {
+      end += iov[i].iov_len;
+    }
+    while (count > 0) {
+      ssize_t done = pwritev(fd, iov, count, offset);
+      if (done < 0) {
+        return;
+      }
+      offset += done;
+      // Skip what was written, a partial write can end inside a buffer.
+      while (count > 0 && static_cast<std::size_t>(done) >= iov->iov_len) {
+        done -= iov->iov_len;
+        iov++;
+        count--;
+      }
+      if (count > 0) {
+        iov->iov_base = static_cast<char *>(iov->iov_base) + done;
+        iov->iov_len -= done;
+      }
+    }
+    if (end > length) {
+      length = end;
+    }
+  }
+
+  /**
+   * @return offset the bytes were written at, the old end of the file.
+   */
+  std::size_t append(const void *src, std::size_t n) {
+    std::size_t offset = length;
+    write(offset, src, n);
+    return offset;
+  }
+
+  /**
+   * @brief Drop every byte of the file, name is unused.
+   */
+  void truncate(const std::string &) {
+    if (ftruncate(fd, 0) == 0) {
+      length = 0;
+    }
+  }
+
+  /**
+   * @brief Make every write so far durable.
+   */
+  void sync() { fsync(fd); }
+};
+
+/**
+ * @brief Byte-addressed file mapped into memory.
+ * @note The mapping grows geometrically with ftruncate and mremap, so pointers
+ * from data() stay valid only until the next append() on the same file. The
+ * file is cut back to its used length on close().
+ */
+class MappedFile {
+private:
+  static constexpr std::size_t MIN_MAPPING = 1 << 20;
+
+  int fd = -1;
+  char *base = nullptr;
+  std::size_t mapped = 0;
+  std::size_t length = 0;
+
+  /**
+   * @return false, leaving the mapping as it was, if the file or the mapping
+   * cannot grow to needed bytes.
+   */
+  bool reserve(std::size_t needed) {
+    if (needed <= mapped) {
+      return true;
+    }
+    if (fd < 0) {
+      return false;
+    }
+    std::size_t target = mapped * 2 > MIN_MAPPING ? mapped * 2 : MIN_MAPPING;
+    while (target < needed) {
+      target *= 2;
+    }
+    if (ftruncate(fd, target) != 0) {
+      return false;
+    }
+    void *region =
+        base == nullptr
+            ? mmap(nullptr, target, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+            : mremap(base, mapped, target, MREMAP_MAYMOVE);
+    if (region == MAP_FAILED) {
+      // The old mapping is still in place, give the file back its size.
+      if (ftruncate(fd, mapped) != 0) {
+        // Zeros past the mapping, cut back to the used length on close().
+      }
+      return false;
+    }
+    base = static_cast<char *>(region);
+    mapped = target;
+    return true;
+  }
+
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() { close(); }
+
+  /**
+   * @brief Open name for reading and writing, creating it if missing.
+   */
+  void open(const std::string &name) {
+    close();
+    fd = ::open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    length = st.st_size;
+    reserve(length > 0 ? length : 1);
+  }
+
+  void close() {
+    if (fd < 0) {
+      return;
+    }
+    if (base != nullptr) {
+      munmap(base, mapped);
+    }
+    if (ftruncate(fd, length) != 0) {
+      // The tail is zeros past the used length, harmless if left behind.
+    }
+    ::close(fd);
+    fd = -1;
+    base = nullptr;
+    mapped = 0;
+    length = 0;
+  }
+
+  std::size_t size() const { return length; }
+
+  /**
+   * @brief Zero-copy access to the bytes at offset.
+   */
+  char *data(std::size_t offset) { return base + offset; }
+
+  void read(std::size_t offset, void *dst, std::size_t n) {
+    std::size_t got = offset < length ? std::min(n, length - offset) : 0;
+    if (got > 0) {
+      std::memcpy(dst, base + offset, got);
+    }
+    std::memset(static_cast<char *>(dst) + got, 0, n - got); // as PosixFile
+  }
+
+  /**
+   * @note The write is dropped, as by PosixFile, if the file cannot grow.
+   */
+  void write(std::size_t offset, const void *src, std::size_t n) {
+    if (!reserve(offset + n)) {
+      return;
+    }
+    std::memcpy(base + offset, src, n);
+    if (offset + n > length) {
+      length = offset + n;
+    }
+  }
+
+  void writev(std::size_t offset, iovec *iov, int count) {
+    std::size_t end = offset;
+    for (int i = 0; i < count; i++) {
+      end += iov[i].iov_len;
+    }
+    if (!reserve(end)) {
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      write(offset, iov[i].iov_base, iov[i].iov_len);
+      offset += iov[i].iov_len;
+    }
+  }
+
+  /**
+   * @return offset the bytes were written at, the old end of the file.
+   */
+  std::size_t append(const void *src, std::size_t n) {
+    std::size_t offset = length;
+    write(offset, src, n);
+    return offset;
+  }
+
+  /**
+   * @brief Drop every byte of the file, name is unused.
+   */
+  void truncate(const std::string &) {
+    std::memset(base, 0, length < mapped ? length : mapped);
+    length = 0;
+  }
+
+  /**
+   * @brief Make every write so far durable.
+   */
+  void sync() {
+    if (base != nullptr) {
+      msync(base, length, MS_SYNC);
+    }
+  }
+};
+
+#endif // FILE_BACKEND_HPP
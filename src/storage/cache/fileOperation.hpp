@@ -1,42 +1,67 @@
 #ifndef BPT_FILEOPERATION_HPP
 #define BPT_FILEOPERATION_HPP
 
+#include "fileBackend.hpp"
+#include <cstdio>
 #include <fstream>
+#include <limits>
 
 using std::fstream;
 using std::ifstream;
 using std::ofstream;
 using std::string;
 
-template <class T, int info_len = 2> class FileOperation {
+/**
+ * @tparam File byte-level backend, PosixFile or MappedFile.
+ * @note The header holds info_len user ints followed by the head of the free
+ * list, padded so that every record is aligned. A removed record stores the
+ * index of the next free record in its first bytes, and write() reuses the
+ * head of the list before appending. Both backends share this layout.
+ */
+template <class T, int info_len = 2, class File = PosixFile>
+class FileOperation {
+  static_assert(sizeof(T) >= sizeof(int), "a free record must hold an index");
+
 private:
-  fstream file;
+  File file;
   string file_name;
   int sizeofT = sizeof(T);
+  int free_head = 0; // 0 is the header, so it never names a record
+
+  static constexpr int IOV_BATCH = 64;
+
+  static constexpr int header_size =
+      ((info_len + 1) * sizeof(int) + alignof(T) - 1) / alignof(T) *
+      alignof(T);
+
+  void write_header() {
+    char header[header_size] = {};
+    file.write(0, header, header_size);
+    free_head = 0;
+  }
+
+  void write_free_head() {
+    file.write(info_len * sizeof(int), &free_head, sizeof(int));
+  }
+
+  void open() {
+    file.open(file_name);
+    if (file.size() == 0) {
+      write_header();
+    } else {
+      file.read(info_len * sizeof(int), &free_head, sizeof(int));
+    }
+  }
 
 public:
   FileOperation() = default;
 
   FileOperation(const string &file_name) : file_name(file_name) {}
 
-  ~FileOperation() {
-    if (file.is_open())
-      file.close();
-  }
-
   void initialise(string FN = "") {
     if (FN != "")
       file_name = FN;
-    file.open(file_name, std::ios::in | std::ios::out | std::ios::binary);
-    if (!file.is_open()) {
-      file.clear();
-      file.open(file_name, std::ios::out | std::ios::binary);
-      file.close();
-      file.open(file_name, std::ios::in | std::ios::out | std::ios::binary);
-      int tmp = 0;
-      for (int i = 0; i < info_len; ++i)
-        file.write(reinterpret_cast<char *>(&tmp), sizeof(int));
-    }
+    open();
   }
 
   //读出第n个int的值赋给tmp，1_base
@@ -44,8 +69,7 @@ public:
     if (n > info_len)
       return;
 
-    file.seekg((n - 1) * sizeof(int));
-    file.read(reinterpret_cast<char *>(&tmp), sizeof(int));
+    file.read((n - 1) * sizeof(int), &tmp, sizeof(int));
   }
 
   //将tmp写入第n个int的位置，1_base
@@ -53,57 +77,112 @@ public:
     if (n > info_len)
       return;
 
-    file.seekp((n - 1) * sizeof(int));
-    file.write(reinterpret_cast<char *>(&tmp), sizeof(int));
+    file.write((n - 1) * sizeof(int), &tmp, sizeof(int));
   }
 
   //在文件合适位置写入类对象t，并返回写入的位置索引index
   int write(T &t) {
-    file.seekp(0, std::ios::end);
-    int index = file.tellp();
-    file.write(reinterpret_cast<char *>(&t), sizeof(T));
+    if (free_head == 0) {
+      return append(t);
+    }
+    int index = free_head;
+    file.read(index, &free_head, sizeof(int));
+    write_free_head();
+    update(t, index);
     return index;
   }
 
+  //在文件末尾写入t，连续调用得到相邻的位置
+  int append(T &t) { return file.append(&t, sizeof(T)); }
+
+  /**
+   * @brief Index the next append() returns.
+   */
+  int end_index() { return file.size(); }
+
   //用t的值更新位置索引index对应的对象
   void update(T &t, const int index) {
     if (index == -1) {
       return;
     }
-    file.seekp(index);
-    file.write(reinterpret_cast<char *>(&t), sizeof(T));
+    file.write(index, &t, sizeof(T));
   }
 
   //读出位置索引index对应的T对象的值并赋值给t
-  void read(T &t, const int index) {
-    file.seekg(index);
-    file.read(reinterpret_cast<char *>(&t), sizeof(T));
-  }
+  void read(T &t, const int index) { file.read(index, &t, sizeof(T)); }
 
-  //删除位置索引index对应的对象
+  //删除位置索引index对应的对象，其空间留给之后的write
   void remove(int index) {
-    // No implementation needed for space recovery
+    if (index < header_size) {
+      return;
+    }
+    file.write(index, &free_head, sizeof(int));
+    free_head = index;
+    write_free_head();
   }
 
-  bool isEmpty() {
-    file.seekg(0, std::ios::end);
-    return file.tellg() == info_len * sizeof(int);
+  bool isEmpty() { return file.size() == header_size; }
+
+  //用path处的文件替换当前文件，并重新打开
+  void replace_with(const string &path) {
+    file.close();
+    std::rename(path.c_str(), file_name.c_str());
+    open();
   }
 
   void clear() {
-    file.clear();
-    file.close();
-    file.open(file_name, std::ios::out | std::ios::binary);
-    file.close();
-    file.open(file_name, std::ios::in | std::ios::out | std::ios::binary);
-    int tmp = 0;
-    for (int i = 0; i < info_len; ++i)
-      file.write(reinterpret_cast<char *>(&tmp), sizeof(int));
-    file.flush();
-    file.clear();
-    file.seekg(0);
-    file.seekp(0);
+    file.truncate(file_name);
+    write_header();
   }
+
+  /**
+   * @brief Write count records whose indices are sorted and distinct.
+   * @note Records that sit next to each other on disk go out in one vectored
+   * write, so a batch costs one call per contiguous run.
+   */
+  void update_sorted(const int *indices, const T *const *records, int count) {
+    iovec iov[IOV_BATCH];
+    int i = 0;
+    while (i < count) {
+      int run = 0;
+      int start = indices[i];
+      do {
+        iov[run].iov_base = const_cast<T *>(records[i]);
+        iov[run].iov_len = sizeof(T);
+        run++;
+        i++;
+      } while (i < count && run < IOV_BATCH &&
+               indices[i] == indices[i - 1] + sizeofT);
+      file.writev(start, iov, run);
+    }
+  }
+
+  /**
+   * @brief Make every write so far durable.
+   */
+  void sync() { file.sync(); }
+
+  /**
+   * @brief Zero-copy access to the record at index, MappedFile only.
+   * @note The pointer is invalidated by the next append() or write().
+   */
+  T *view(const int index) {
+    return reinterpret_cast<T *>(file.data(index));
+  }
+
+  // Buffer pool interface, so that a mapped file can back BPTStorage directly.
+  T *pin(const int index) { return view(index); }
+  void unpin(const int, bool) {}
+  static constexpr std::size_t capacity() {
+    return std::numeric_limits<std::size_t>::max();
+  }
+  void flush() {} // mapped writes are already in the page cache
 };
 
-#endif // BPT_FILEOPERATION_HPP
\ No newline at end of file
+/**
+ * @brief FileOperation over a memory-mapped file.
+ */
+template <class T, int info_len = 2>
+using MmapFileOperation = FileOperation<T, info_len, MappedFile>;
+
+#endif // BPT_FILEOPERATION_HPP
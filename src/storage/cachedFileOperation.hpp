@@ -3,10 +3,29 @@
 
 #include "cache/LRUKCache.hpp"
 #include "cache/fileOperation.hpp"
+#include "stl/vector.hpp"
+#include <algorithm>
 #include <string>
 
+// Memory granted to every buffer pool, the frame count is derived from it.
+constexpr std::size_t BUFFER_POOL_BYTES = 1 << 20;
+constexpr std::size_t BUFFER_POOL_MIN_FRAMES = 16;
+
+template <class T> constexpr std::size_t buffer_pool_frames() {
+  return BUFFER_POOL_BYTES / sizeof(T) > BUFFER_POOL_MIN_FRAMES
+             ? BUFFER_POOL_BYTES / sizeof(T)
+             : BUFFER_POOL_MIN_FRAMES;
+}
+
+/**
+ * @brief Bounded buffer pool over a FileOperation.
+ * @note Records are cached with LRU-K replacement. Dirty records are written
+ * back when evicted, on flush() and on destruction; flush() sorts them by
+ * offset and writes adjacent ones together. pin() hands out a pointer to the
+ * resident copy that stays valid (and resident) until unpin().
+ */
 template <class T, int info_len = 2, std::size_t K = 4,
-          std::size_t CACHE = 8192>
+          std::size_t CACHE = buffer_pool_frames<T>()>
 class CachedFileOperation {
   using Key = int;
 
@@ -25,7 +44,7 @@ public:
   explicit CachedFileOperation(const std::string &fn)
       : disk(fn), cache(write_back, this) {}
 
-  ~CachedFileOperation() { cache.flush(); }
+  ~CachedFileOperation() { flush(); }
 
   void initialise(std::string fn = "") { disk.initialise(fn); }
   void get_info(int &tmp, int n) { disk.get_info(tmp, n); }
@@ -38,6 +57,12 @@ public:
     return idx;
   }
 
+  int append(T &t) {
+    int idx = disk.append(t);
+    cache.put(idx, t, false);
+    return idx;
+  }
+
   void read(T &t, const int idx) {
     if (!cache.get(idx, t)) {
       disk.read(t, idx);
@@ -45,19 +70,82 @@ public:
     }
   }
 
-  void update(T &t, const int idx) { cache.put(idx, t, true); }
+  void update(T &t, const int idx) {
+    if (idx == -1) {
+      return;
+    }
+    cache.put(idx, t, true);
+  }
+
+  /**
+   * @brief Pin the record at idx, loading it if needed.
+   * @return nullptr if the record is not resident and every frame is pinned.
+   * @note Every pin() that succeeds must be paired with an unpin() on the same
+   * index.
+   */
+  T *pin(const int idx) {
+    T *frame = cache.pin(idx);
+    if (frame == nullptr) {
+      T t;
+      disk.read(t, idx);
+      if (cache.put(idx, t, false)) {
+        frame = cache.pin(idx);
+      }
+    }
+    return frame;
+  }
+
+  void unpin(const int idx, bool dirty) { cache.unpin(idx, dirty); }
+
+  /**
+   * @brief Number of frames in the pool, an upper bound on pinned records.
+   */
+  static constexpr std::size_t capacity() { return CACHE; }
 
   void remove(int idx) {
-    cache.flush();
+    cache.erase(idx);
     disk.remove(idx);
   }
 
-  void flush() { cache.flush(); }
+  void flush() {
+    sjtu::vector<std::pair<int, const T *>> dirty;
+    cache.take_dirty([&dirty](const Key &idx, const T &obj) {
+      dirty.push_back({idx, &obj});
+    });
+    if (dirty.empty()) {
+      return;
+    }
+    std::sort(dirty.begin(), dirty.end());
+    sjtu::vector<int> indices;
+    sjtu::vector<const T *> records;
+    for (size_t i = 0; i < dirty.size(); i++) {
+      indices.push_back(dirty[i].first);
+      records.push_back(dirty[i].second);
+    }
+    disk.update_sorted(indices.data(), records.data(), dirty.size());
+  }
+
+  /**
+   * @brief flush(), then make the file durable.
+   */
+  void sync() {
+    flush();
+    disk.sync();
+  }
 
   void clear() {
-    cache.clear();
+    cache.discard();
     disk.clear();
   }
+
+  /**
+   * @brief Swap in the file at path, dropping every cached record.
+   * @note Dirty records are discarded, flush() first to keep them.
+   */
+  void replace_with(const std::string &path) {
+    cache.discard();
+    disk.replace_with(path);
+  }
 };
 
-#endif // CACHED_FILE_OPERATION_HPP
\ No newline at end of file
+#endif // CACHED_FILE_OPERATION_HPP
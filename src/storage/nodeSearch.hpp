@@ -0,0 +1,153 @@
+#ifndef NODE_SEARCH_HPP
+#define NODE_SEARCH_HPP
+
+#include <cstddef>
+#include <utility>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define NODE_SEARCH_X86 1
+#endif
+
+namespace node_search {
+
+/**
+ * @brief Branchless binary search over keys[0, n), using only operator>.
+ */
+template <typename Key>
+inline int binary_lower_bound(const Key *keys, int n, const Key &key) {
+  if (n <= 0) {
+    return 0;
+  }
+  const Key *base = keys;
+  int len = n;
+  while (len > 1) {
+    int half = len / 2;
+    base += (key > base[half - 1]) ? half : 0;
+    len -= half;
+  }
+  return static_cast<int>(base - keys) + (key > *base ? 1 : 0);
+}
+
+// Candidates left for the linear kernel once the binary search stops.
+constexpr int WINDOW = 16;
+
+/**
+ * @brief Halve [base, base + len) until at most WINDOW keys remain.
+ * @note The lower bound of the whole range always lies in [base, base + len].
+ */
+template <typename Key>
+inline const Key *narrow(const Key *base, int &len, const Key &key) {
+  while (len > WINDOW) {
+    int half = len / 2;
+    base += (key > base[half - 1]) ? half : 0;
+    len -= half;
+  }
+  return base;
+}
+
+template <typename Key>
+inline int count_less(const Key *keys, int n, const Key &key) {
+  int count = 0;
+  for (int i = 0; i < n; i++) {
+    count += (key > keys[i]) ? 1 : 0;
+  }
+  return count;
+}
+
+#ifdef NODE_SEARCH_X86
+inline bool has_avx2() {
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+
+// AVX2 only has a signed 64-bit compare, flipping the sign bit makes it
+// order unsigned values.
+__attribute__((target("avx2"))) inline __m256i flip_sign(__m256i v) {
+  return _mm256_xor_si256(v, _mm256_set1_epi64x(0x8000000000000000ll));
+}
+
+__attribute__((target("avx2"))) inline int
+count_less_avx2(const size_t *keys, int n, size_t key) {
+  const __m256i needle = flip_sign(_mm256_set1_epi64x(key));
+  int count = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = flip_sign(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)));
+    int mask = _mm256_movemask_pd(
+        _mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, v)));
+    count += __builtin_popcount(mask);
+  }
+  return count + count_less(keys + i, n - i, key);
+}
+
+// Two pairs per vector, laid out as first, second, first, second.
+__attribute__((target("avx2"))) inline int
+count_less_avx2(const std::pair<size_t, size_t> *keys, int n,
+                const std::pair<size_t, size_t> &key) {
+  static_assert(sizeof(std::pair<size_t, size_t>) == 2 * sizeof(size_t),
+                "pair<size_t, size_t> must be two packed words");
+  const __m256i needle = flip_sign(_mm256_setr_epi64x(
+      key.first, key.second, key.first, key.second));
+  int count = 0;
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m256i v = flip_sign(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)));
+    int gt = _mm256_movemask_pd(
+        _mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, v)));
+    int eq = _mm256_movemask_pd(
+        _mm256_castsi256_pd(_mm256_cmpeq_epi64(needle, v)));
+    // Bit 2k of less: pair k's first is smaller, or equal with smaller second.
+    int less = gt | (eq & (gt >> 1));
+    count += __builtin_popcount(less & 0b0101);
+  }
+  return count + count_less(keys + i, n - i, key);
+}
+#endif
+
+template <typename Key>
+inline int lower_bound_vectorized(const Key *keys, int n, const Key &key) {
+  if (n <= 0) {
+    return 0;
+  }
+  int len = n;
+  const Key *base = narrow(keys, len, key);
+#ifdef NODE_SEARCH_X86
+  if (has_avx2()) {
+    return static_cast<int>(base - keys) + count_less_avx2(base, len, key);
+  }
+#endif
+  return static_cast<int>(base - keys) + count_less(base, len, key);
+}
+
+} // namespace node_search
+
+/**
+ * @brief Lower bound over the sorted keys of a tree node.
+ * @return index of the first key that is not less than key, or n.
+ * @note The generic version is a branchless binary search. Key types the tree
+ * is instantiated with in practice are specialized below: they narrow with the
+ * same binary search and count the last few candidates with AVX2.
+ */
+template <typename Key> struct NodeSearch {
+  static int lower_bound(const Key *keys, int n, const Key &key) {
+    return node_search::binary_lower_bound(keys, n, key);
+  }
+};
+
+template <> struct NodeSearch<size_t> {
+  static int lower_bound(const size_t *keys, int n, const size_t &key) {
+    return node_search::lower_bound_vectorized(keys, n, key);
+  }
+};
+
+template <> struct NodeSearch<std::pair<size_t, size_t>> {
+  static int lower_bound(const std::pair<size_t, size_t> *keys, int n,
+                         const std::pair<size_t, size_t> &key) {
+    return node_search::lower_bound_vectorized(keys, n, key);
+  }
+};
+
+#endif // NODE_SEARCH_HPP
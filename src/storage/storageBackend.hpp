@@ -0,0 +1,27 @@
+#ifndef STORAGE_BACKEND_HPP
+#define STORAGE_BACKEND_HPP
+
+#include "cache/fileOperation.hpp"
+#include "cachedFileOperation.hpp"
+
+/**
+ * @brief Storage backends the services are built with.
+ * @note Defining TICKET_SYSTEM_MMAP memory-maps every file instead of going
+ * through pread/pwrite. Mapped tree pages are then used in place, without the
+ * LRU-K buffer pool in front of them.
+ */
+#ifdef TICKET_SYSTEM_MMAP
+template <class T, int info_len>
+using DefaultPageManager = MmapFileOperation<T, info_len>;
+template <class T, int info_len>
+using DefaultRecordFile = MmapFileOperation<T, info_len>;
+using DefaultByteFile = MappedFile;
+#else
+template <class T, int info_len>
+using DefaultPageManager = CachedFileOperation<T, info_len>;
+template <class T, int info_len>
+using DefaultRecordFile = FileOperation<T, info_len>;
+using DefaultByteFile = PosixFile;
+#endif
+
+#endif // STORAGE_BACKEND_HPP
@@ -0,0 +1,22 @@
+// Offline compaction: run from the directory holding the data files, while
+// the ticket system is not running. Every B+ tree file is rewritten densely,
+// dropping the pages its free list was holding, and the station runs of
+// deleted trains are dropped.
+#include "services/orderManager.hpp"
+#include "services/trainManager.hpp"
+#include "services/userManager.hpp"
+#include <iostream>
+
+int main() {
+  freopen("cerr.log", "w", stderr);
+
+  UserManager userManager("users");
+  TrainManager trainManager("trains");
+  OrderManager orderManager("orders", &trainManager);
+
+  userManager.compact();
+  trainManager.compact();
+  orderManager.compact();
+  std::cout << "compacted\n";
+  return 0;
+}
@@ -9,6 +9,10 @@
 
 using sjtu::map;
 
+// Dirty pages are written back every FLUSH_INTERVAL commands and made durable
+// once, on exit.
+constexpr int FLUSH_INTERVAL = 1000;
+
 int main() {
   //freopen("../test/TicketSystem/63.in", "r", stdin);
   freopen("cerr.log", "w", stderr);
@@ -18,7 +22,14 @@ int main() {
   OrderManager orderManager("orders", &trainManager);
 
   std::string line;
+  int commands = 0;
   while (getline(std::cin, line)) {
+    if (++commands % FLUSH_INTERVAL == 0) {
+      userManager.flush();
+      trainManager.flush();
+      orderManager.flush();
+    }
+
     int timestamp;
     std::string command;
     map<char, std::string> params;
@@ -34,6 +45,13 @@ int main() {
 
     std::cout << "[" << timestamp << "] ";
 
+    // Runs of add_train and release_train go into the trees in one batch.
+    if (command == "add_train" || command == "release_train") {
+      trainManager.beginBulkLoad();
+    } else {
+      trainManager.endBulkLoad();
+    }
+
     try {
       if (command == "add_user") {
         bool result = userManager.addUser(params['c'], params['u'], params['p'],
@@ -165,6 +183,9 @@ int main() {
       } else if (command == "exit") {
         LOG("exit command received, clearing logged in users");
         userManager.clearLoggedInUsers();
+        userManager.flush(true);
+        trainManager.flush(true);
+        orderManager.flush(true);
         LOG("System shutdown");
         std::cout << "bye";
         break;
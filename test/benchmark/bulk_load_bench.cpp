@@ -0,0 +1,67 @@
+// Loads a timetable with add_train + release_train, once train by train and
+// once as a bulk load, and reports the time taken and the size of the trees.
+//
+// usage: bulk_load_bench [trains] [stations per train]
+#include "services/trainManager.hpp"
+#include "timetable.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+namespace {
+
+using timetable::add_train;
+using timetable::file_size;
+using timetable::remove_files;
+
+constexpr int STATION_POOL = 2000;
+
+// The files a bulk load builds bottom-up.
+const char *const TREE_FILES[] = {
+    "_train_node",          "_train_data",          "_station_stop_node",
+    "_station_stop_data",   "_transfer_lookup_node", "_transfer_lookup_data"};
+void run(const char *name, bool bulk, int trains, int stations) {
+  std::string prefix = "bulk_load_bench";
+  remove_files(prefix);
+  std::mt19937 rng(2024);
+  auto start = std::chrono::steady_clock::now();
+  {
+    TrainManager manager(prefix);
+    if (bulk) {
+      manager.beginBulkLoad();
+    }
+    for (int t = 0; t < trains; t++) {
+      std::string id = "T" + std::to_string(t);
+      add_train(manager, rng, id, STATION_POOL, stations);
+      manager.releaseTrain(id.c_str());
+    }
+    if (bulk) {
+      manager.endBulkLoad();
+    }
+    manager.flush();
+  }
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  long long trees = 0;
+  for (const char *suffix : TREE_FILES) {
+    trees += file_size(prefix + suffix);
+  }
+  std::printf("%-14s %9.1f ms  %8.1f us/train  trees %9.1f KiB\n", name, ms,
+              ms * 1000 / trains, trees / 1024.0);
+  remove_files(prefix);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int trains = argc > 1 ? std::atoi(argv[1]) : 10000;
+  int stations = argc > 2 ? std::atoi(argv[2]) : 30;
+  std::printf("%d trains of %d stations over %d stations\n", trains, stations,
+              STATION_POOL);
+  run("train by train", false, trains, stations);
+  run("bulk load", true, trains, stations);
+  return 0;
+}
@@ -0,0 +1,190 @@
+// Replays the page accesses BPTStorage makes on the storage robustness
+// workload against the map-scan LRU-K cache the buffer pool used to have and
+// the current heap-indexed LRUKCache, reporting hit rate and ns per access.
+//
+// usage: lruk_cache_bench [workload] (default: test/storage/robust/large.in)
+#include "stl/map.hpp"
+#include "stl/vector.hpp"
+#include "storage/bptStorage.hpp"
+#include "storage/cache/LRUKCache.hpp"
+#include "utils/string32.hpp"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+
+namespace {
+
+sjtu::vector<int> trace;
+int next_tag = 0;
+
+// Buffer pool that records every page it is asked for. Node and data pages
+// are told apart by the file they come from.
+template <class T, int info_len>
+class TracingFileOperation : public CachedFileOperation<T, info_len> {
+  using Base = CachedFileOperation<T, info_len>;
+  int tag = next_tag++;
+
+public:
+  void read(T &t, const int idx) {
+    trace.push_back(idx * 2 + tag);
+    Base::read(t, idx);
+  }
+  void update(T &t, const int idx) {
+    trace.push_back(idx * 2 + tag);
+    Base::update(t, idx);
+  }
+  T *pin(const int idx) {
+    trace.push_back(idx * 2 + tag);
+    return Base::pin(idx);
+  }
+};
+
+// The cache as it was before the heap index: eviction scans every entry.
+template <class Key, class Value, std::size_t K, std::size_t MaxResidency>
+class LegacyLRUKCache {
+  struct Entry {
+    Value val;
+    bool dirty = false;
+    std::size_t hist[K];
+    std::size_t hist_count = 0;
+    std::size_t hist_head = 0;
+
+    void push_history(std::size_t time) {
+      std::size_t tail = (hist_head + hist_count) % K;
+      hist[tail] = time;
+      if (hist_count < K) {
+        hist_count++;
+      } else {
+        hist_head = (hist_head + 1) % K;
+      }
+    }
+
+    std::size_t get_kth_history() const {
+      return hist_count < K ? 0 : hist[hist_head];
+    }
+  };
+
+  sjtu::map<Key, Entry> map;
+  std::size_t clk = 0;
+
+  void evict() {
+    auto victim_it = map.end();
+    std::size_t min_time = std::numeric_limits<std::size_t>::max();
+    for (auto it = map.begin(); it != map.end(); ++it) {
+      if (it->second.get_kth_history() < min_time) {
+        min_time = it->second.get_kth_history();
+        victim_it = it;
+      }
+    }
+    map.erase(victim_it);
+  }
+
+public:
+  bool get(const Key &k, Value &out) {
+    auto it = map.find(k);
+    if (it == map.end()) {
+      return false;
+    }
+    it->second.push_history(++clk);
+    out = it->second.val;
+    return true;
+  }
+
+  void put(const Key &k, const Value &v, bool dirty) {
+    if (map.size() >= MaxResidency) {
+      evict();
+    }
+    Entry &e = map[k];
+    e.val = v;
+    e.dirty = dirty;
+    e.push_history(++clk);
+  }
+};
+
+struct Page {
+  char bytes[512];
+};
+
+template <class Cache> void replay(const char *name, Cache &cache) {
+  Page page{};
+  std::size_t hits = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int key : trace) {
+    if (cache.get(key, page)) {
+      hits++;
+    } else {
+      cache.put(key, page, false);
+    }
+  }
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  std::printf("  %-8s hit rate %6.2f%%  %8.1f ns/op\n", name,
+              100.0 * hits / trace.size(), double(ns) / trace.size());
+}
+
+template <std::size_t CAPACITY> void compare() {
+  std::printf("capacity %zu\n", CAPACITY);
+  auto *legacy = new LegacyLRUKCache<int, Page, 4, CAPACITY>();
+  replay("legacy", *legacy);
+  delete legacy;
+  auto *current = new LRUKCache<int, Page, 4, CAPACITY>(nullptr, nullptr);
+  replay("current", *current);
+  delete current;
+}
+
+struct CustomStringHasher {
+  size_t operator()(const char *str) const {
+    size_t hash = 5381;
+    int c;
+    while ((c = *str++)) {
+      hash = ((hash << 5) + hash) + c + 33;
+    }
+    return hash;
+  }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::ifstream input(argc > 1 ? argv[1] : "../../test/storage/robust/large.in");
+  if (!input) {
+    std::cerr << "cannot open workload" << std::endl;
+    return 1;
+  }
+  std::remove("lruk_bench_node");
+  std::remove("lruk_bench_data");
+  {
+    BPTStorage<size_t, int, 20, 20, TracingFileOperation> tree(
+        "lruk_bench", std::numeric_limits<size_t>::max());
+    CustomStringHasher hasher;
+    int n;
+    input >> n;
+    std::string op;
+    sjtu::string32 index;
+    int value;
+    for (int i = 0; i < n; ++i) {
+      input >> op >> index;
+      if (op == "insert") {
+        input >> value;
+        tree.insert(hasher(index.c_str()), value);
+      } else if (op == "delete") {
+        input >> value;
+        tree.remove(hasher(index.c_str()), value);
+      } else {
+        tree.find(hasher(index.c_str()));
+      }
+    }
+  }
+  std::remove("lruk_bench_node");
+  std::remove("lruk_bench_data");
+  std::printf("%zu page accesses\n", trace.size());
+
+  compare<64>();
+  compare<256>();
+  compare<1024>();
+  return 0;
+}
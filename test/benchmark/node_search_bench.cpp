@@ -0,0 +1,104 @@
+// Measures the cost of locating a key inside one B+ tree node, for the node
+// sizes the services use. Compares the linear scan BPTStorage used to do with
+// the generic branchless binary search and the specialized NodeSearch kernels.
+//
+// usage: node_search_bench
+#include "storage/nodeSearch.hpp"
+#include "stl/vector.hpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <utility>
+
+namespace {
+
+constexpr int QUERIES = 1 << 20;
+
+template <typename Key>
+int linear_scan(const Key *keys, int n, const Key &key) {
+  int i = 0;
+  while (i < n && key > keys[i]) {
+    i++;
+  }
+  return i;
+}
+
+template <typename Key> Key make_key(std::mt19937_64 &rng);
+
+template <> size_t make_key<size_t>(std::mt19937_64 &rng) { return rng(); }
+
+// ticketLookupDB keys share their first half across many entries.
+template <>
+std::pair<size_t, size_t> make_key<std::pair<size_t, size_t>>(
+    std::mt19937_64 &rng) {
+  return {rng() % 64, rng()};
+}
+
+template <typename Key, typename Search>
+double time_search(const char *name, const sjtu::vector<Key> &keys,
+                   const sjtu::vector<Key> &queries, Search search,
+                   long long &checksum) {
+  int n = keys.size();
+  const Key *data = &keys[0];
+  long long sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t q = 0; q < queries.size(); q++) {
+    sum += search(data, n, queries[q]);
+  }
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  if (checksum == -1) {
+    checksum = sum;
+  } else if (checksum != sum) {
+    std::printf("  %s disagrees with the linear scan\n", name);
+  }
+  return static_cast<double>(ns) / queries.size();
+}
+
+template <typename Key> void run(const char *type_name, int node_size) {
+  std::mt19937_64 rng(node_size);
+  sjtu::vector<Key> keys;
+  for (int i = 0; i < node_size; i++) {
+    keys.push_back(make_key<Key>(rng));
+  }
+  // Insertion sort keeps this to the operators the tree itself relies on.
+  for (int i = 1; i < node_size; i++) {
+    Key k = keys[i];
+    int j = i - 1;
+    while (j >= 0 && keys[j] > k) {
+      keys[j + 1] = keys[j];
+      j--;
+    }
+    keys[j + 1] = k;
+  }
+  sjtu::vector<Key> queries;
+  for (int i = 0; i < QUERIES; i++) {
+    // Half of the lookups hit an existing key, as tree descents mostly do.
+    queries.push_back(i % 2 ? keys[rng() % node_size] : make_key<Key>(rng));
+  }
+
+  long long checksum = -1;
+  double linear = time_search("linear", keys, queries, linear_scan<Key>,
+                              checksum);
+  double binary = time_search("binary", keys, queries,
+                              node_search::binary_lower_bound<Key>, checksum);
+  double special = time_search("special", keys, queries,
+                               NodeSearch<Key>::lower_bound, checksum);
+  std::printf("%-20s %4d keys  linear %7.1f  binary %6.1f  special %6.1f "
+              "ns/level\n",
+              type_name, node_size, linear, binary, special);
+}
+
+} // namespace
+
+int main() {
+  const int sizes[] = {17, 30, 80, 250, 500};
+  for (int size : sizes) {
+    run<size_t>("size_t", size);
+  }
+  for (int size : sizes) {
+    run<std::pair<size_t, size_t>>("pair<size_t,size_t>", size);
+  }
+  return 0;
+}
@@ -0,0 +1,81 @@
+// Compares the two QueryEngine indexes on long trains: the cost of
+// releaseTrain, the size of the index files on disk and query_ticket latency.
+//
+// usage: query_engine_bench [trains] [stations per train]
+#include "services/trainManager.hpp"
+#include "timetable.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+namespace {
+
+using timetable::add_train;
+using timetable::file_size;
+using timetable::remove_files;
+using timetable::station_name;
+
+constexpr int STATION_POOL = 400;
+constexpr int QUERIES = 2000;
+
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void run(const char *name, QueryEngine engine, int trains, int stations) {
+  std::string prefix = "query_engine_bench";
+  remove_files(prefix);
+  std::mt19937 rng(2024);
+  double release_ms, query_ms;
+  {
+    TrainManager manager(prefix, engine);
+    for (int t = 0; t < trains; t++) {
+      add_train(manager, rng, "T" + std::to_string(t), STATION_POOL, stations);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < trains; t++) {
+      manager.releaseTrain(("T" + std::to_string(t)).c_str());
+    }
+    manager.flush();
+    release_ms = elapsed_ms(start);
+
+    start = std::chrono::steady_clock::now();
+    size_t answers = 0;
+    for (int q = 0; q < QUERIES; q++) {
+      std::string from = station_name(rng() % STATION_POOL);
+      std::string to = station_name(rng() % STATION_POOL);
+      answers += manager
+                     .queryTicket(from.c_str(), to.c_str(), "07-15",
+                                  q % 2 ? "cost" : "time")
+                     .size();
+    }
+    query_ms = elapsed_ms(start);
+    std::printf("%-16s release %8.3f ms/train  query %8.1f us  (%zu bytes "
+                "of answers)\n",
+                name, release_ms / trains, query_ms * 1000 / QUERIES, answers);
+  }
+  long long index = engine == QueryEngine::PairIndex
+                        ? file_size(prefix + "_ticket_lookup_node") +
+                              file_size(prefix + "_ticket_lookup_data")
+                        : file_size(prefix + "_station_stop_node") +
+                              file_size(prefix + "_station_stop_data");
+  std::printf("%-16s index on disk %10.1f KiB\n", name, index / 1024.0);
+  remove_files(prefix);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int trains = argc > 1 ? std::atoi(argv[1]) : 200;
+  int stations = argc > 2 ? std::atoi(argv[2]) : 100;
+  std::printf("%d trains of %d stations over %d stations\n", trains, stations,
+              STATION_POOL);
+  run("pair index", QueryEngine::PairIndex, trains, stations);
+  run("station postings", QueryEngine::StationPostings, trains, stations);
+  return 0;
+}
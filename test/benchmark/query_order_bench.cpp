@@ -0,0 +1,110 @@
+// Measures the storage side of query_order for users with thousands of orders:
+// orderDB.find() as it is now, returning storage order, against the same scan
+// followed by the recursive quicksort find() used to run on every result.
+//
+// usage: query_order_bench
+#include "services/orderManager.hpp"
+#include "stl/vector.hpp"
+#include "storage/bptStorage.hpp"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <string>
+
+namespace {
+
+constexpr int USERS = 4;
+constexpr int ROUNDS = 5;
+
+// The sort find() used to apply: Lomuto partition with the last element as
+// pivot, quadratic on the already sorted input it always received.
+void legacy_sort(sjtu::vector<Order> &vec) {
+  if (vec.size() <= 1) {
+    return;
+  }
+  auto partition = [&vec](int low, int high) {
+    Order pivot = vec[high];
+    int i = low - 1;
+    for (int j = low; j < high; j++) {
+      if (vec[j] <= pivot) {
+        i++;
+        Order temp = vec[i];
+        vec[i] = vec[j];
+        vec[j] = temp;
+      }
+    }
+    Order temp = vec[i + 1];
+    vec[i + 1] = vec[high];
+    vec[high] = temp;
+    return i + 1;
+  };
+  std::function<void(int, int)> quicksort = [&](int low, int high) {
+    if (low < high) {
+      int pi = partition(low, high);
+      quicksort(low, pi - 1);
+      quicksort(pi + 1, high);
+    }
+  };
+  quicksort(0, vec.size() - 1);
+}
+
+template <class Fn> double time_us(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < ROUNDS; r++) {
+    fn();
+  }
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  return static_cast<double>(us) / ROUNDS;
+}
+
+void run(int orders_per_user) {
+  std::string prefix = "query_order_bench";
+  std::remove((prefix + "_node").c_str());
+  std::remove((prefix + "_data").c_str());
+  BPTStorage<size_t, Order, 500, 17> orderDB(
+      prefix, std::numeric_limits<size_t>::max());
+
+  // Users buy in turns, as timestamps interleave in a real session.
+  int timestamp = 0;
+  for (int i = 0; i < orders_per_user; i++) {
+    for (size_t user = 0; user < USERS; user++) {
+      Order order;
+      order.timestamp = ++timestamp;
+      order.status = SUCCESS;
+      orderDB.insert(user, order);
+    }
+  }
+
+  size_t checked = 0;
+  double current = time_us([&]() {
+    for (size_t user = 0; user < USERS; user++) {
+      checked += orderDB.find(user).size();
+    }
+  });
+  double legacy = time_us([&]() {
+    for (size_t user = 0; user < USERS; user++) {
+      sjtu::vector<Order> orders = orderDB.find(user);
+      legacy_sort(orders);
+      checked += orders.size();
+    }
+  });
+  std::printf("%6d orders/user  find %9.1f us  find+quicksort %11.1f us  "
+              "(%zu rows)\n",
+              orders_per_user, current / USERS, legacy / USERS, checked);
+
+  std::remove((prefix + "_node").c_str());
+  std::remove((prefix + "_data").c_str());
+}
+
+} // namespace
+
+int main() {
+  const int sizes[] = {100, 1000, 3000, 10000};
+  for (int size : sizes) {
+    run(size);
+  }
+  return 0;
+}
@@ -0,0 +1,76 @@
+// Measures query_transfer on long trains and reports how much of each join
+// the bounds let it skip.
+//
+// usage: query_transfer_bench [trains] [stations per train]
+#include "services/trainManager.hpp"
+#include "timetable.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+namespace {
+
+using timetable::add_train;
+using timetable::remove_files;
+using timetable::station_name;
+
+constexpr int STATION_POOL = 400;
+constexpr int QUERIES = 500;
+
+void add_trains(TrainManager &manager, std::mt19937 &rng, int trains,
+                int stations) {
+  for (int t = 0; t < trains; t++) {
+    std::string id = "T" + std::to_string(t);
+    add_train(manager, rng, id, STATION_POOL, stations);
+    manager.releaseTrain(id.c_str());
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int trains = argc > 1 ? std::atoi(argv[1]) : 200;
+  int stations = argc > 2 ? std::atoi(argv[2]) : 100;
+  std::string prefix = "query_transfer_bench";
+  remove_files(prefix);
+  std::mt19937 rng(2024);
+  {
+    TrainManager manager(prefix);
+    add_trains(manager, rng, trains, stations);
+    std::printf("%d trains of %d stations over %d stations\n", trains,
+                stations, STATION_POOL);
+
+    const char *const orders[] = {"time", "cost"};
+    for (const char *sortBy : orders) {
+      size_t pairs = 0, evaluated = 0, pruned = 0, found = 0;
+      size_t lookups = 0, hits = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (int q = 0; q < QUERIES; q++) {
+        std::string from = station_name(rng() % STATION_POOL);
+        std::string to = station_name(rng() % STATION_POOL);
+        found += !manager.queryTransfer(from.c_str(), to.c_str(), "07-15",
+                                        sortBy)
+                      .empty();
+        const TransferStats &stats = manager.transferStats();
+        pairs += stats.pairs;
+        evaluated += stats.evaluated;
+        pruned += stats.pruned;
+        lookups += stats.lookups.trains + stats.lookups.seatRows;
+        hits += stats.lookups.trainHits + stats.lookups.seatRowHits;
+      }
+      double us = std::chrono::duration<double, std::micro>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+      std::printf("-p %s  %8.1f us/query  %zu found  pairs %zu  evaluated "
+                  "%zu (%.1f%%)  pruned %zu (%.1f%%)  lookups %zu (%.1f%% "
+                  "from memory)\n",
+                  sortBy, us / QUERIES, found, pairs, evaluated,
+                  100.0 * evaluated / pairs, pruned, 100.0 * pruned / pairs,
+                  lookups, 100.0 * hits / lookups);
+    }
+  }
+  remove_files(prefix);
+  return 0;
+}
@@ -0,0 +1,72 @@
+// Compares the seat row of one train run kept as a plain array, scanned and
+// rewritten segment by segment, against the SeatRow now stored per run, on
+// long trips over long trains.
+//
+// usage: seat_row_bench [segments]
+#include "services/trainManager.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace {
+
+constexpr int OPERATIONS = 2000000;
+
+template <class Fn> double time_ns(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         OPERATIONS;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int segments = argc > 1 ? std::atoi(argv[1]) : 99;
+  // Trips cover most of the train, as through traffic does.
+  std::vector<int> from(OPERATIONS), to(OPERATIONS);
+  std::mt19937 rng(2024);
+  for (int i = 0; i < OPERATIONS; i++) {
+    from[i] = rng() % (segments / 10 + 1);
+    to[i] = segments - rng() % (segments / 10 + 1);
+  }
+
+  long long checksum = 0;
+  std::vector<int> row(segments, 1 << 30);
+  double array_ns = time_ns([&]() {
+    for (int i = 0; i < OPERATIONS; i++) {
+      int left = *std::min_element(row.begin() + from[i], row.begin() + to[i]);
+      if (i % 2) {
+        checksum += left;
+      } else if (left > 0) {
+        for (int j = from[i]; j < to[i]; j++) {
+          row[j]--;
+        }
+      }
+    }
+  });
+
+  std::vector<int> nodes(SeatRow::size(segments));
+  SeatRow::init(nodes.data(), segments, 1 << 30);
+  SeatRow seats(nodes.data(), segments);
+  double row_ns = time_ns([&]() {
+    for (int i = 0; i < OPERATIONS; i++) {
+      int left = seats.min(from[i], to[i]);
+      if (i % 2) {
+        checksum -= left;
+      } else if (left > 0) {
+        seats.add(from[i], to[i], -1);
+      }
+    }
+  });
+
+  std::printf("%d segments  array %6.1f ns/op  seat row %6.1f ns/op  "
+              "(checksum %lld)\n",
+              segments, array_ns, row_ns, checksum);
+  return 0;
+}
@@ -0,0 +1,65 @@
+// Shared by the TrainManager benchmarks: random trains through a pool of
+// stations, and the files a TrainManager keeps under a prefix.
+#ifndef BENCHMARK_TIMETABLE_HPP
+#define BENCHMARK_TIMETABLE_HPP
+
+#include "services/trainManager.hpp"
+#include <cstdio>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+namespace timetable {
+
+const char *const FILE_SUFFIXES[] = {
+    "_train_node",           "_train_data",           "_ticket_lookup_node",
+    "_ticket_lookup_data",   "_station_stop_node",    "_station_stop_data",
+    "_transfer_lookup_node", "_transfer_lookup_data", "_station_bucket",
+    "_ticket_bucket"};
+
+inline std::string station_name(int i) { return "S" + std::to_string(i); }
+
+inline long long file_size(const std::string &name) {
+  struct stat st;
+  return stat(name.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+inline void remove_files(const std::string &prefix) {
+  for (const char *suffix : FILE_SUFFIXES) {
+    std::remove((prefix + suffix).c_str());
+  }
+}
+
+/**
+ * @brief Add train id on a random route through distinct stations of a pool
+ * of pool, with random fares and times, on sale all summer.
+ */
+inline int add_train(TrainManager &manager, std::mt19937 &rng,
+                     const std::string &id, int pool, int stations) {
+  std::vector<int> order(pool);
+  for (int i = 0; i < pool; i++) {
+    order[i] = i;
+  }
+  std::string route, prices, travel, stopover;
+  for (int i = 0; i < stations; i++) {
+    int j = i + rng() % (pool - i);
+    std::swap(order[i], order[j]);
+    route += (i ? "|" : "") + station_name(order[i]);
+    if (i > 0) {
+      prices += (i > 1 ? "|" : "") + std::to_string(1 + rng() % 100);
+      travel += (i > 1 ? "|" : "") + std::to_string(10 + rng() % 50);
+    }
+    if (i > 0 && i < stations - 1) {
+      stopover += (i > 1 ? "|" : "") + std::to_string(1 + rng() % 10);
+    }
+  }
+  return manager.addTrain(id.c_str(), stations, 1000, route, prices, "08:00",
+                          travel, stations > 2 ? stopover : "_",
+                          "06-01|08-31", 'G');
+}
+
+} // namespace timetable
+
+#endif // BENCHMARK_TIMETABLE_HPP
@@ -1,10 +1,19 @@
 #include <gtest/gtest.h>
 #include <storage/bptStorage.hpp>
+#include <services/orderManager.hpp>
+#include <services/trainManager.hpp>
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <cstdio> // Required for std::remove
+#include <map>
+#include <random>
+#include <set>
+#include <csignal>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 // Helper function to execute commands from input file
 void executeCommands(BPTStorage<int, int>& storage, const std::string& inputFile, const std::string& outputFile) {
@@ -94,3 +103,450 @@ TEST(StorageTest, TestCase6) {
     std::remove("test6.db_data");
     std::remove("test6.db_node");
 }
+
+TEST(StorageTest, RangeScan) {
+    std::remove("range.db_data");
+    std::remove("range.db_node");
+    {
+        BPTStorage<std::pair<int, int>, int, 4, 4> storage("range.db", {INT_MAX, INT_MAX});
+        for (int i = 0; i < 200; i++) {
+            storage.insert({i % 10, i}, i);
+        }
+
+        std::vector<int> prefix;
+        storage.for_each_prefix({3, INT_MIN}, [&](const std::pair<int, int>& key, int value) {
+            EXPECT_EQ(key.first, 3);
+            prefix.push_back(value);
+            return true;
+        });
+        ASSERT_EQ(prefix.size(), 20u);
+        for (size_t i = 1; i < prefix.size(); i++) {
+            EXPECT_LT(prefix[i - 1], prefix[i]);
+        }
+
+        std::vector<int> first;
+        storage.range({2, 0}, {7, 0}, [&](const std::pair<int, int>&, int value) {
+            first.push_back(value);
+            return first.size() < 5;
+        });
+        EXPECT_EQ(first, (std::vector<int>{2, 12, 22, 32, 42}));
+
+        auto it = storage.lower_bound({9, 195});
+        ASSERT_TRUE(it.valid());
+        EXPECT_EQ(it.value(), 199);
+        it.next();
+        EXPECT_FALSE(it.valid());
+    }
+    std::remove("range.db_data");
+    std::remove("range.db_node");
+}
+
+// find() returns storage order, which must be ascending even when equal keys
+// fill many blocks and entries come and go in between.
+TEST(StorageTest, FindIsSorted) {
+    std::remove("sorted.db_data");
+    std::remove("sorted.db_node");
+    {
+        BPTStorage<int, int, 5, 4> storage("sorted.db", INT_MAX);
+        std::map<int, std::multiset<int>> model;
+        std::mt19937 rng(42);
+        for (int i = 0; i < 20000; i++) {
+            int key = rng() % 8;
+            auto& values = model[key];
+            if (values.empty() || rng() % 3 != 0) {
+                int value = rng() % 1000;
+                storage.insert(key, value);
+                values.insert(value);
+            } else {
+                auto it = values.begin();
+                std::advance(it, rng() % values.size());
+                storage.remove(key, *it);
+                values.erase(it);
+            }
+        }
+        for (const auto& [key, values] : model) {
+            auto result = storage.find(key);
+            std::vector<int> got;
+            for (const auto& value : result) {
+                got.push_back(value);
+            }
+            std::vector<int> expected(values.begin(), values.end());
+            EXPECT_EQ(got, expected);
+        }
+    }
+    std::remove("sorted.db_data");
+    std::remove("sorted.db_node");
+}
+
+// insert_sorted() rebuilds small trees and inserts into large ones; either way
+// the tree must match plain inserts and keep working afterwards.
+TEST(StorageTest, InsertSorted) {
+    std::remove("bulk.db_data");
+    std::remove("bulk.db_node");
+    std::multiset<std::pair<int, int>> model;
+    std::mt19937 rng(5);
+    auto batch = [&](int n) {
+        std::vector<std::pair<int, int>> entries;
+        for (int i = 0; i < n; i++) {
+            entries.push_back({static_cast<int>(rng() % 50),
+                               static_cast<int>(rng() % 1000)});
+        }
+        std::sort(entries.begin(), entries.end());
+        model.insert(entries.begin(), entries.end());
+        return entries;
+    };
+    auto check = [&](BPTStorage<int, int, 5, 4>& storage) {
+        std::vector<std::pair<int, int>> got;
+        for (auto it = storage.begin(); it.valid(); it.next()) {
+            got.push_back({it.key(), it.value()});
+        }
+        std::vector<std::pair<int, int>> expected(model.begin(), model.end());
+        EXPECT_EQ(got, expected);
+        EXPECT_EQ(storage.size(), model.size());
+        for (int key = 0; key < 50; key++) {
+            size_t count = std::distance(model.lower_bound({key, INT_MIN}),
+                                         model.lower_bound({key + 1, INT_MIN}));
+            EXPECT_EQ(storage.find(key).size(), count);
+        }
+    };
+    {
+        BPTStorage<int, int, 5, 4> storage("bulk.db", INT_MAX);
+        for (int n : {3000, 300, 10}) { // rebuild, merge, insert one by one
+            auto entries = batch(n);
+            storage.insert_sorted(entries.data(), entries.size());
+            check(storage);
+            for (int i = 0; i < 2000; i++) {
+                int key = rng() % 50, value = rng() % 1000;
+                if (rng() % 2) {
+                    storage.insert(key, value);
+                    model.insert({key, value});
+                } else if (model.count({key, value})) {
+                    storage.remove(key, value);
+                    model.erase(model.find({key, value}));
+                }
+            }
+            check(storage);
+        }
+    }
+    BPTStorage<int, int, 5, 4> reopened("bulk.db", INT_MAX);
+    check(reopened);
+    std::remove("bulk.db_data");
+    std::remove("bulk.db_node");
+}
+
+// A full pool of pinned frames refuses new entries and writes them through,
+// and a clean put() keeps a pending write-back.
+TEST(LRUKCacheTest, WritesThroughWhenEveryFrameIsPinned) {
+    std::map<int, int> disk;
+    auto writer = [](const int& key, const int& value, void* context) {
+        (*static_cast<std::map<int, int>*>(context))[key] = value;
+    };
+    LRUKCache<int, int, 2, 4> cache(writer, &disk);
+    for (int key = 0; key < 4; key++) {
+        ASSERT_TRUE(cache.put(key, key, false));
+        ASSERT_NE(cache.pin(key), nullptr);
+    }
+    EXPECT_FALSE(cache.put(9, 90, true));
+    EXPECT_FALSE(cache.contains(9));
+    EXPECT_EQ(disk[9], 90);
+    EXPECT_FALSE(cache.put(8, 80, false));
+    EXPECT_EQ(disk.count(8), 0u);
+
+    cache.unpin(0, false);
+    EXPECT_TRUE(cache.put(0, 10, true));
+    EXPECT_TRUE(cache.put(0, 10, false));
+    cache.flush();
+    EXPECT_EQ(disk[0], 10);
+    for (int key = 1; key < 4; key++) {
+        cache.unpin(key, false);
+    }
+    EXPECT_TRUE(cache.put(9, 91, false)); // evicts again
+}
+
+TEST(SeatRowTest, MatchesArray) {
+    std::mt19937 rng(7);
+    for (int segments : {1, 2, 3, 7, 64, 99}) {
+        std::vector<int> nodes(SeatRow::size(segments));
+        SeatRow::init(nodes.data(), segments, 100);
+        std::vector<int> seats(segments, 100);
+        SeatRow row(nodes.data(), segments);
+        for (int i = 0; i < 2000; i++) {
+            int from = rng() % segments;
+            int to = from + 1 + rng() % (segments - from);
+            if (rng() % 2) {
+                int delta = static_cast<int>(rng() % 21) - 10;
+                row.add(from, to, delta);
+                for (int j = from; j < to; j++) {
+                    seats[j] += delta;
+                }
+            } else {
+                int expected = *std::min_element(seats.begin() + from,
+                                                 seats.begin() + to);
+                ASSERT_EQ(row.min(from, to), expected);
+            }
+        }
+        auto values = row.values();
+        for (int j = 0; j < segments; j++) {
+            EXPECT_EQ(values[j], seats[j]);
+        }
+    }
+}
+
+TEST(TicketBucketTest, WritesBackOnEvictionAndClose) {
+    std::remove("tickets.db");
+    const int trains = 90, days = 50; // more rows than frames
+    const int lengths[] = {10, 10, 150}; // the last does not fit a frame
+    std::vector<int> buckets;
+    std::vector<std::vector<int>> seats; // by bucket and day, then segment
+    std::mt19937 rng(11);
+    {
+        TicketBucketManager tickets("tickets.db");
+        for (int t = 0; t < trains; t++) {
+            int segments = lengths[t % 3];
+            buckets.push_back(tickets.addTickets(days, segments, 500));
+            for (int day = 0; day < days; day++) {
+                seats.push_back(std::vector<int>(segments, 500));
+            }
+        }
+        for (int i = 0; i < 20000; i++) {
+            int t = rng() % trains, day = rng() % days;
+            int segments = lengths[t % 3];
+            int from = rng() % segments;
+            int to = from + 1 + rng() % (segments - from);
+            auto &row = seats[t * days + day];
+            int expected = *std::min_element(row.begin() + from,
+                                             row.begin() + to);
+            ASSERT_EQ(tickets.minTickets(buckets[t], day, segments, from, to),
+                      expected);
+            int delta = -static_cast<int>(rng() % 30);
+            if (tickets.addTickets(buckets[t], day, segments, from, to,
+                                   delta)) {
+                for (int j = from; j < to; j++) {
+                    row[j] += delta;
+                }
+            }
+        }
+    }
+    TicketBucketManager tickets("tickets.db");
+    for (int t = 0; t < trains; t++) {
+        for (int day = 0; day < days; day++) {
+            auto left = tickets.queryTickets(buckets[t], day, lengths[t % 3]);
+            const auto &row = seats[t * days + day];
+            ASSERT_EQ(static_cast<int>(left.size()), lengths[t % 3]);
+            for (size_t j = 0; j < row.size(); j++) {
+                ASSERT_EQ(left[j], row[j]);
+            }
+        }
+    }
+    std::remove("tickets.db");
+}
+
+TEST(TicketBucketTest, TakesRequestsInTurn) {
+    std::remove("tickets.db");
+    TicketBucketManager tickets("tickets.db");
+    const int segments = 40;
+    int batch = tickets.addTickets(1, segments, 100);
+    int single = tickets.addTickets(1, segments, 100);
+    std::mt19937 rng(5);
+    for (int round = 0; round < 50; round++) {
+        vector<SeatRequest> requests;
+        for (int i = 0; i < 20; i++) {
+            int from = rng() % segments;
+            int to = from + 1 + rng() % (segments - from);
+            requests.push_back(SeatRequest{from, to, 1 + int(rng() % 40)});
+        }
+        vector<int> taken = tickets.takeTickets(batch, 0, segments, requests);
+        size_t next = 0;
+        for (size_t i = 0; i < requests.size(); i++) {
+            const SeatRequest &request = requests[i];
+            bool fits = tickets.addTickets(single, 0, segments, request.from,
+                                           request.to, -request.num);
+            bool got = next < taken.size() && taken[next] == int(i);
+            ASSERT_EQ(got, fits);
+            next += got;
+        }
+        ASSERT_EQ(next, taken.size());
+        for (int j = 0; j < segments; j++) {
+            ASSERT_EQ(tickets.minTickets(batch, 0, segments, j, j + 1),
+                      tickets.minTickets(single, 0, segments, j, j + 1));
+        }
+        tickets.addTickets(batch, 0, segments, 0, segments, 30); // refunds
+        tickets.addTickets(single, 0, segments, 0, segments, 30);
+    }
+    std::remove("tickets.db");
+}
+
+// compact() drops the station runs of deleted trains and the trains left
+// still find theirs, before and after reopening.
+TEST(TrainManagerTest, CompactDropsDeletedStationRuns) {
+    const char* const suffixes[] = {
+        "_train_node", "_train_data", "_ticket_lookup_node",
+        "_ticket_lookup_data", "_station_stop_node", "_station_stop_data",
+        "_transfer_lookup_node", "_transfer_lookup_data", "_station_bucket",
+        "_ticket_bucket"};
+    auto remove_files = [&]() {
+        for (const char* suffix : suffixes) {
+            std::remove((std::string("compact_test") + suffix).c_str());
+        }
+    };
+    auto bucket_size = []() {
+        struct stat st;
+        return stat("compact_test_station_bucket", &st) == 0 ? st.st_size : 0;
+    };
+    remove_files();
+    const int trains = 20;
+    std::vector<std::string> kept;
+    long before;
+    {
+        TrainManager manager("compact_test");
+        for (int t = 0; t < trains; t++) {
+            std::string route;
+            for (int i = 0; i < 10; i++) {
+                route += (i ? "|S" : "S") + std::to_string(t * 10 + i);
+            }
+            std::string id = "T" + std::to_string(t);
+            manager.addTrain(id.c_str(), 10, 100, route,
+                             "1|2|3|4|5|6|7|8|9", "08:00",
+                             "10|10|10|10|10|10|10|10|10",
+                             "1|1|1|1|1|1|1|1", "06-01|08-31", 'G');
+        }
+        for (int t = 0; t < trains; t += 2) {
+            ASSERT_EQ(manager.deleteTrain(("T" + std::to_string(t)).c_str()),
+                      0);
+        }
+        manager.releaseTrain("T1");
+        for (int t = 1; t < trains; t += 2) {
+            kept.push_back(manager.queryTrain(
+                ("T" + std::to_string(t)).c_str(), "07-01"));
+        }
+        manager.flush();
+        before = bucket_size();
+        manager.compact();
+        EXPECT_EQ(bucket_size(), before / 2);
+        for (int t = 1; t < trains; t += 2) {
+            EXPECT_EQ(manager.queryTrain(("T" + std::to_string(t)).c_str(),
+                                         "07-01"),
+                      kept[t / 2]);
+        }
+    }
+    {
+        TrainManager manager("compact_test");
+        for (int t = 1; t < trains; t += 2) {
+            EXPECT_EQ(manager.queryTrain(("T" + std::to_string(t)).c_str(),
+                                         "07-01"),
+                      kept[t / 2]);
+        }
+        EXPECT_EQ(manager.queryTrain("T0", "07-01"), "-1");
+    }
+    remove_files();
+}
+
+TEST(OrderLogTest, FindsNthNewest) {
+    const char* const files[] = {"log_order_table", "log_order_chunk",
+                                 "log_order_log_node", "log_order_log_data"};
+    for (const char* file : files) {
+        std::remove(file);
+    }
+    std::vector<std::vector<int>> model(5); // timestamps by user, oldest first
+    std::mt19937 rng(3);
+    {
+        OrderLog log("log_order");
+        for (int i = 0; i < 3000; i++) {
+            size_t user = rng() % 5;
+            Order order;
+            order.timestamp = i;
+            order.status = SUCCESS;
+            log.append(user, order);
+            model[user].push_back(i);
+        }
+    }
+    OrderLog log("log_order");
+    for (size_t user = 0; user < 5; user++) {
+        int total = model[user].size();
+        ASSERT_EQ(log.count(user), total);
+        EXPECT_EQ(log.find(user, 0), -1);
+        EXPECT_EQ(log.find(user, total + 1), -1);
+        for (int n = 1; n <= total; n += 7) {
+            Order order;
+            log.read(order, log.find(user, n));
+            EXPECT_EQ(order.timestamp, model[user][total - n]);
+        }
+        auto orders = log.list(user);
+        ASSERT_EQ(static_cast<int>(orders.size()), total);
+        for (int i = 0; i < total; i++) {
+            EXPECT_EQ(orders[i].timestamp, model[user][i]);
+        }
+    }
+    EXPECT_EQ(log.count(7), 0);
+    for (const char* file : files) {
+        std::remove(file);
+    }
+}
+
+// overlaps() may report a false positive on the last bit, never a miss.
+TEST(PendingSummaryTest, OverlapsEveryCoveredLeg) {
+    std::mt19937 rng(9);
+    for (int round = 0; round < 200; round++) {
+        const int segments = 1 + rng() % 150;
+        PendingSummary summary;
+        std::vector<bool> covered(segments, false);
+        int minNum = INT_MAX;
+        for (int i = 0; i < 3; i++) {
+            int from = rng() % segments;
+            int to = from + 1 + rng() % (segments - from);
+            int num = 1 + rng() % 50;
+            summary.add(from, to, num);
+            std::fill(covered.begin() + from, covered.begin() + to, true);
+            minNum = std::min(minNum, num);
+        }
+        EXPECT_EQ(summary.minNum, minNum);
+        for (int from = 0; from < segments; from++) {
+            for (int to = from + 1; to <= segments; to++) {
+                bool shared = std::find(covered.begin() + from,
+                                        covered.begin() + to,
+                                        true) != covered.begin() + to;
+                if (to < PendingSummary::BITS) { // clear of the shared bit
+                    ASSERT_EQ(summary.overlaps(from, to), shared);
+                } else if (shared) {
+                    ASSERT_TRUE(summary.overlaps(from, to));
+                }
+            }
+        }
+    }
+}
+
+// A mapping that cannot grow drops the write instead of running past its end.
+TEST(MappedFileTest, DropsWritesThatCannotGrowTheFile) {
+    std::remove("mapped.db");
+    const rlim_t cap = 1 << 20; // the first mapping, see MappedFile
+    rlimit old;
+    getrlimit(RLIMIT_FSIZE, &old);
+    auto handler = std::signal(SIGXFSZ, SIG_IGN); // fail with EFBIG instead
+    rlimit capped = old;
+    capped.rlim_cur = cap;
+    ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &capped), 0);
+    {
+        MappedFile file;
+        file.open("mapped.db");
+        char page[4096];
+        for (size_t i = 0; i < cap / sizeof(page); i++) {
+            std::memset(page, static_cast<int>(i % 128), sizeof(page));
+            EXPECT_EQ(file.append(page, sizeof(page)), i * sizeof(page));
+        }
+        EXPECT_EQ(file.size(), cap);
+        file.append(page, sizeof(page));
+        file.write(cap + 100, page, 1);
+        iovec iov[2] = {{page, 8}, {page, 8}};
+        file.writev(cap - 8, iov, 2);
+        EXPECT_EQ(file.size(), cap);
+
+        char back[8];
+        file.read(cap - 8, back, sizeof(back));
+        EXPECT_EQ(back[0], static_cast<char>((cap / sizeof(page) - 1) % 128));
+        file.read(cap + 4096, back, sizeof(back)); // past the end reads zeros
+        EXPECT_EQ(back[0], 0);
+    }
+    setrlimit(RLIMIT_FSIZE, &old);
+    std::signal(SIGXFSZ, handler);
+    std::remove("mapped.db");
+}